@@ -51,9 +51,14 @@
 ////                                                              ////
 //////////////////////////////////////////////////////////////////////
 
+#include <stdint.h>
+
 #include "cfg.h"
 #include "defs.h"
 #include "tps65217.h"
+#include "i2cq.h"
+#include "sched.h"
+#include "boottime.h"
 
 //----------------------------------------------------------------------------
 unsigned int boardInit(void);
@@ -61,6 +66,8 @@ unsigned int boardInitOlimexino5510Orsoc8695ep4gx(void);
 unsigned int boardInitOrdb3a(void);
 void ledFlash(int numFlashes, int infiniteLoop);
 
+#define NELEM(a) (sizeof (a) / sizeof (a)[0])
+
 //----------------------------------------------------------------------------
 // boardInit
 //----------------------------------------------------------------------------
@@ -76,6 +83,11 @@ unsigned int boardInit(void)
 }
 
 #ifdef OLIMEXINO5510_ORSOC8695EP4GX
+// Voltage plan, see tps65217_setRegs()
+static const struct tps65217_regval railsOlimexino5510Orsoc8695ep4gx[] = {
+	{ TPS65217_DEFDCDC3, TPS65217_DEFDCDC_1V2 },
+};
+
 unsigned int boardInitOlimexino5510Orsoc8695ep4gx(void)
 {
 	unsigned char chipId;
@@ -94,14 +106,8 @@ unsigned int boardInitOlimexino5510Orsoc8695ep4gx(void)
 		}
 	}
 
-	result |= tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_DEFDCDC3);
-	result |= tps65217_wrReg(TPS65217_DEFDCDC3, TPS65217_DEFDCDC_1V2);
-	result |= tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_DEFDCDC3);
-	result |= tps65217_wrReg(TPS65217_DEFDCDC3, TPS65217_DEFDCDC_1V2);
-	result |= tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_DEFSLEW);
-	result |= tps65217_wrReg(TPS65217_DEFSLEW,  TPS65217_DEFSLEW_GO | TPS65217_DEFSLEW_FAST);
-	result |= tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_DEFSLEW);
-	result |= tps65217_wrReg(TPS65217_DEFSLEW,  TPS65217_DEFSLEW_GO | TPS65217_DEFSLEW_FAST);
+	result |= tps65217_setRegs(railsOlimexino5510Orsoc8695ep4gx, NELEM(railsOlimexino5510Orsoc8695ep4gx));
+	result |= tps65217_wrRegPw2(TPS65217_DEFSLEW, TPS65217_DEFSLEW_GO | TPS65217_DEFSLEW_FAST);
 
 	// TODO: init FPGA
 	return result;
@@ -109,6 +115,47 @@ unsigned int boardInitOlimexino5510Orsoc8695ep4gx(void)
 #endif
 
 #ifdef ORDB3A
+// Voltage plan: level 2 protected registers, set and verified by
+// tps65217_setRegs() before the GO bit copies them to the regulators
+static const struct tps65217_regval railsOrdb3a[] = {
+	{ TPS65217_DEFDCDC1, TPS65217_DEFDCDC_1V5 },
+	{ TPS65217_DEFDCDC2, TPS65217_DEFDCDC_3V3 },
+	{ TPS65217_DEFDCDC3, TPS65217_DEFDCDC_1V1 },
+	{ TPS65217_DEFLDO1, TPS65217_DEFLDO_3V3 },
+	{ TPS65217_DEFLDO2, TPS65217_DEFLDO_1V1 },
+	{ TPS65217_DEFLS1, TPS65217_DEFLS_LDO | TPS65217_DEFLS_2V5 },
+	{ TPS65217_DEFLS2, TPS65217_DEFLS_LS | TPS65217_DEFLS_3V3 },
+	// Power sequence for SEQUP/SEQDWN (fpga_powerup/down), at the
+	// shortest strobe delays: core and transceivers, then PLL and
+	// DDR, then IO. SEQDWN runs it backwards. The MCU (LDO1) and the
+	// unused LS2 are not part of it.
+	{ TPS65217_SEQ1, TPS65217_SEQ1_DC1(2) | TPS65217_SEQ1_DC2(3) },
+	{ TPS65217_SEQ2, TPS65217_SEQ2_DC3(1) | TPS65217_SEQ2_LDO1(0) },
+	{ TPS65217_SEQ3, TPS65217_SEQ3_LDO2(1) | TPS65217_SEQ3_LS1(2) },
+	{ TPS65217_SEQ4, TPS65217_SEQ4_LS2(0) },
+	{ TPS65217_SEQ5, TPS65217_SEQ5_DLY1(1) | TPS65217_SEQ5_DLY2(1) |
+			 TPS65217_SEQ5_DLY3(1) | TPS65217_SEQ5_DLY4(1) },
+};
+
+/* Enable lines */
+/* Sequencer will power up all other rails, just turn on uC and VBUS */
+static const struct tps65217_regval enableOrdb3a[] = {
+	{ TPS65217_ENABLE, TPS65217_ENABLE_LDO1_EN | // MCU
+			   TPS65217_ENABLE_DC1_EN |
+			   TPS65217_ENABLE_DC2_EN |
+			   TPS65217_ENABLE_DC3_EN |
+			   TPS65217_ENABLE_LDO2_EN |
+			   TPS65217_ENABLE_LS1_EN },  // Not LS2, unused
+};
+
+// Rails the FPGA needs, as reported in PGOOD
+#define FPGA_RAILS_PG	(TPS65217_PGOOD_DC1_PG | TPS65217_PGOOD_DC2_PG | \
+			 TPS65217_PGOOD_DC3_PG | TPS65217_PGOOD_LDO2_PG | \
+			 TPS65217_PGOOD_LS1_PG)
+// PGOOD reads after SEQUP before giving up; the sequence is 3 strobes
+// of 1ms, and a read takes some 50us
+#define FPGA_PG_POLLS	200
+
 unsigned int boardInitOrdb3a(void)
 {
 	unsigned char chipId;
@@ -121,6 +168,7 @@ unsigned int boardInitOrdb3a(void)
 
 	do {
 		LED_OFF;
+		boottime.pmic_tries++;
 		swi2cmst_init();
 		swi2cmst_clrbus();
 		result = tps65217_chipId(&chipId);
@@ -135,54 +183,33 @@ unsigned int boardInitOrdb3a(void)
 			continue;
 		}
 
-		// TODO: Check if there are power sequncing requirements
-		/* Macro to set a level 2 password-protected register, read back and verify */
-#define SET_TPS_REG_PW2(reg,val) { unsigned char rv;			\
-			result |= tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^(reg)); \
-			result |= tps65217_wrReg(reg, val);		\
-			result |= tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^(reg)); \
-			result |= tps65217_wrReg(reg, val);		\
-			result |= tps65217_rdReg(reg, &rv);		\
-			if (rv != (val)) continue;			\
-		}
-
-		SET_TPS_REG_PW2(TPS65217_DEFDCDC1, TPS65217_DEFDCDC_1V5);
-		SET_TPS_REG_PW2(TPS65217_DEFDCDC2, TPS65217_DEFDCDC_3V3);
-		SET_TPS_REG_PW2(TPS65217_DEFDCDC3, TPS65217_DEFDCDC_1V1);
-		SET_TPS_REG_PW2(TPS65217_DEFLDO1, TPS65217_DEFLDO_3V3);
-		SET_TPS_REG_PW2(TPS65217_DEFLDO2, TPS65217_DEFLDO_1V1);
-		SET_TPS_REG_PW2(TPS65217_DEFLS1, TPS65217_DEFLS_LDO | TPS65217_DEFLS_2V5);
-		SET_TPS_REG_PW2(TPS65217_DEFLS2, TPS65217_DEFLS_LS | TPS65217_DEFLS_3V3);
+		// Only the entries that failed readback are written again
+		result = tps65217_setRegs(railsOrdb3a, NELEM(railsOrdb3a));
+		if (result != TPS65217_OK)
+			continue;
 
 		/* Now that all the voltages are set, we might want to turn the power on. */
 
 		/* Copy the new values into active registers for all regulators */
 		/* No readback here, because the GO bit autoclears */
-	result |= tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_DEFSLEW);
-	result |= tps65217_wrReg(TPS65217_DEFSLEW,  TPS65217_DEFSLEW_GO | TPS65217_DEFSLEW_FAST);
-	result |= tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_DEFSLEW);
-	result |= tps65217_wrReg(TPS65217_DEFSLEW,  TPS65217_DEFSLEW_GO | TPS65217_DEFSLEW_FAST);
-
-	/* TODO: at this point, the MSP430 power voltage rises from 1.8V to 3.3V. Scale other 
-	   functions? */
+		tps65217_wrRegPw2(TPS65217_DEFSLEW, TPS65217_DEFSLEW_GO | TPS65217_DEFSLEW_FAST);
 
-	/* Enable lines: FIXME use sequencer? */
-	/* Sequencer will power up all other rails, just turn on uC and VBUS */
-	SET_TPS_REG_PW2(TPS65217_ENABLE, 
-			TPS65217_ENABLE_LDO1_EN | // MCU
-			0x7f /* enable all */);
-	// USB should be possible from here
+		/* TODO: at this point, the MSP430 power voltage rises from 1.8V to 3.3V. Scale other 
+		   functions? */
 
-	// TODO: Fix: It seems like the TP265217 hangs here, with both SCL and SDA low.
-	//       This was found with a quick measurement, which may be inaccurate.
+		result = tps65217_setRegs(enableOrdb3a, NELEM(enableOrdb3a));
+		if (result != TPS65217_OK)
+			continue;
+		// USB should be possible from here
 
-	// TODO: Set sequencing registers
+		// TODO: Fix: It seems like the TP265217 hangs here, with both SCL and SDA low.
+		//       This was found with a quick measurement, which may be inaccurate.
 
 		PWR_EN_ON;	// At this point, PM chip will power up all the other rails
 		LED_ON;  // power management chip detected, so far so good
 		break;  // If we got this far, things are looking good
 
-	//TODO: init FPGA;
+		//TODO: init FPGA;
 	} while (1);
 
 	return result;
@@ -190,42 +217,101 @@ unsigned int boardInitOrdb3a(void)
 
 #define USE_SEQUENCER
 
-void fpga_powerdown(void) {
+/* Power requests go through the I2C queue (i2cq.h), so the main loop
+   carries on while they are sent. Separate requests for up and down
+   keep their order when both are queued. */
 #ifndef USE_SEQUENCER
-	/* Simply shut everything off at once. Don't do this during flash programming. */
-	tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_ENABLE);
-	tps65217_wrReg(TPS65217_ENABLE, TPS65217_ENABLE_LDO1_EN //);  // Keep MCU power
-		       | TPS65217_ENABLE_DC2_EN); // Main 3.3V for debugging purposes
-#else
-	// Alternatively, we could use SEQ6 bits SEQUP and SEQDWN if sequencer was 
-	// set up nicely. The default setting turns on LS2 which we don't need, but 
-	// does leave LDO1 alone, so we could use it. 
-	tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_SEQ6);
-	tps65217_wrReg(TPS65217_SEQ6, TPS65217_SEQ6_SEQDWN);
-#endif	
-}
-
-void fpga_powerup(void) {
-#ifndef USE_SEQUENCER
-	/* Simply turn everything on at once. Don't do this during flash programming. */
-	tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_ENABLE);
-	tps65217_wrReg(TPS65217_ENABLE, 
-		       TPS65217_ENABLE_LDO1_EN |  // MCU power
+/* Simply shut everything off at once. Don't do this during flash programming. */
+static struct i2cq_req powerdownReq = {
+	.op = I2CQ_WRPW1, .reg = TPS65217_ENABLE,
+	.val = TPS65217_ENABLE_LDO1_EN //);  // Keep MCU power
+		       | TPS65217_ENABLE_DC2_EN, // Main 3.3V for debugging purposes
+};
+/* Simply turn everything on at once. Don't do this during flash programming. */
+static struct i2cq_req powerupReq = {
+	.op = I2CQ_WRPW1, .reg = TPS65217_ENABLE,
+	.val = TPS65217_ENABLE_LDO1_EN |  // MCU power
 		       TPS65217_ENABLE_DC1_EN | // 1.5V power for DDR RAM
 		       TPS65217_ENABLE_DC2_EN | // Main 3.3V, including NAND and FPGA IO
 		       TPS65217_ENABLE_DC3_EN | // FPGA core
 		       TPS65217_ENABLE_LDO2_EN | // FPGA transceivers
-		       TPS65217_ENABLE_LS1_EN); // FPGA PLL power
+		       TPS65217_ENABLE_LS1_EN, // FPGA PLL power
 	// Not included: LS2, which is not used inside the module. 
+};
 #else
-	tps65217_wrReg(TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^TPS65217_SEQ6);
-	tps65217_wrReg(TPS65217_SEQ6, TPS65217_SEQ6_SEQUP);
+// SEQ1-SEQ5 are set up by boardInitOrdb3a(). Once SEQUP is sent, PGOOD
+// is polled until the FPGA rails are all up.
+static void powerupDone(struct i2cq_req *r);
+static struct i2cq_req powerdownReq = {
+	.op = I2CQ_WRPW1, .reg = TPS65217_SEQ6,
+	.val = TPS65217_SEQ6_SEQDWN | TPS65217_SEQ6_DLY5_1MS | TPS65217_SEQ6_DLY6_1MS,
+};
+static struct i2cq_req powerupReq = {
+	.op = I2CQ_WRPW1, .reg = TPS65217_SEQ6,
+	.val = TPS65217_SEQ6_SEQUP | TPS65217_SEQ6_DLY5_1MS | TPS65217_SEQ6_DLY6_1MS,
+	.done = powerupDone,
+};
+#endif	
+
+static enum fpga_power powerState = FPGA_POWER_GOOD;	// Up since boot
+static uint8_t pgoodPolls;
+
+static void pgoodDone(struct i2cq_req *r) {
+	if (powerState != FPGA_POWER_RAMP)
+		return;  // Powered down meanwhile
+	if (r->result == TPS65217_OK && (r->val & FPGA_RAILS_PG) == FPGA_RAILS_PG)
+		powerState = FPGA_POWER_GOOD;
+	else if (--pgoodPolls)
+		i2cq_post(r);
+	else
+		powerState = FPGA_POWER_FAIL;
+	if (powerState != FPGA_POWER_RAMP)
+		sched_post(TASK_CONFIG);  // Waiting to reconfigure the FPGA
+}
+
+static struct i2cq_req pgoodReq = {
+	.op = I2CQ_RD, .reg = TPS65217_PGOOD, .done = pgoodDone,
+};
+
+static void powerupDone(struct i2cq_req *r) {
+	if (powerState != FPGA_POWER_RAMP)
+		return;
+	pgoodPolls = FPGA_PG_POLLS;
+	i2cq_post(&pgoodReq);
+}
+
+void fpga_powerdown(void) {
+	powerState = FPGA_POWER_OFF;
+	i2cq_post(&powerdownReq);
+}
+
+void fpga_powerup(void) {
+#ifdef USE_SEQUENCER
+	powerState = FPGA_POWER_RAMP;
+#else
+	powerState = FPGA_POWER_GOOD;  // Trust it
 #endif
+	i2cq_post(&powerupReq);
+}
+
+enum fpga_power fpga_power_state(void) {
+	return powerState;
 }
 
+static unsigned char statusReg;
+
+static void statusDone(struct i2cq_req *r) {
+	if (r->result == TPS65217_OK)
+		statusReg = r->val;
+}
+
+static struct i2cq_req statusReq = {
+	.op = I2CQ_RD, .reg = TPS65217_STATUS, .done = statusDone,
+};
+
+/* Button state from the last STATUS read; asks for a fresh one */
 int check_pushbutton(void) {
-	unsigned char statusReg = 0;
-	tps65217_rdReg(TPS65217_STATUS, &statusReg);
+	i2cq_post(&statusReq);
 	return statusReg & TPS65217_STATUS_PB;
 }
 #endif
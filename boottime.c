@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include <msp430.h>
+
+#include "stats.h"
+#include "boottime.h"
+
+#define BOOT_HZ	(32768UL/8)	/* Before Init_Clock, ACLK from the REFO */
+
+struct boottime boottime = {
+	.boot_hz = BOOT_HZ,
+	.stats_hz = STATS_HZ,
+};
+
+static uint8_t stats_clock;	// TA0 runs as the stats tick
+
+void boottime_start(void) {
+	TA0CTL = TASSEL__ACLK | ID__8 | TACLR | MC__CONTINUOUS;
+	TA0EX0 = TAIDEX_0;
+}
+
+void boottime_clock(void) {
+	if (stats_clock)
+		return;
+	// Boot up to Init_Clock takes well under the 16s TA0R wraps in
+	boottime.clock_ticks = TA0R;
+	stats_clock = 1;
+	TA0CTL &= ~MC_3;  // Hold until stats_init
+}
+
+void boottime_mark(uint8_t phase) {
+	if (boottime.ticks[phase])
+		return;
+	if (stats_clock) {
+		boottime.ticks[phase] = stats_now() | 1;  // Never 0, that is "not yet"
+		boottime.stats_phases |= 1<<phase;
+	} else
+		boottime.ticks[phase] = TA0R | 1;
+}
@@ -0,0 +1,45 @@
+/* Time from main() to a usable board, phase by phase, read by the host
+   with the BOOTTIME_REQUEST vendor request (IN returns struct
+   boottime). The record is kept until the next reset.
+
+   Until Init_Clock, TA0 counts ACLK/8 from the REFO (244us); from
+   stats_init on it is the stats tick (see stats.h). Times are kept in
+   raw ticks of whichever was running, with both rates alongside, and
+   the host converts them: a phase with its bit set in stats_phases
+   ended clock_ticks/boot_hz + ticks/stats_hz seconds in, any other one
+   ticks/boot_hz. */
+
+#define BOOTTIME_REQUEST	0x23
+
+enum boot_phase {
+	BOOT_PMIC,	/* boardInit and ports */
+	BOOT_VCORE,	/* SetVCore */
+	BOOT_CLOCK,	/* Init_Clock */
+	BOOT_NAND,	/* Do_NAND_Probe, or its cache */
+	BOOT_INIT,	/* USB, timers and UART set up, main loop starts */
+	BOOT_USB_ENUM,	/* Host configured us */
+	BOOT_FPGA,	/* FPGA configuration from NAND played */
+	BOOT_PHASES
+};
+
+struct boottime {
+	uint32_t ticks[BOOT_PHASES];	/* End of each phase, 0 if not yet */
+	uint32_t boot_hz;		/* Tick rate until Init_Clock */
+	uint32_t stats_hz;		/* Tick rate from stats_init on */
+	uint32_t clock_ticks;		/* Init_Clock, in boot_hz ticks */
+	uint32_t xsvf_bytes;		/* Read from NAND by the player */
+	uint32_t xsvf_tcks;		/* TCK pulses it gave */
+	int8_t xsvf_result;		/* From libxsvf_play */
+	uint8_t pmic_tries;		/* boardInit loop iterations */
+	uint8_t nand_cached;		/* Probe came from info flash */
+	uint8_t stats_phases;		/* Phases counted in stats_hz ticks */
+};
+
+extern struct boottime boottime;
+
+/* First thing in main */
+extern void boottime_start(void);
+/* ACLK is about to change; stats_init must follow before the next mark */
+extern void boottime_clock(void);
+/* Phase done, unless it was marked before */
+extern void boottime_mark(uint8_t phase);
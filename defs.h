@@ -145,6 +145,14 @@
 #define OK              (TPS65217_OK)
 #define ERROR           (TPS65217_ERROR)
 
+// FPGA power, see fpga_power_state() in boardinit.c
+enum fpga_power {
+	FPGA_POWER_OFF,
+	FPGA_POWER_RAMP,	// Sequencing up, waiting for PGOOD
+	FPGA_POWER_GOOD,
+	FPGA_POWER_FAIL,	// Rails did not come up
+};
+
 #define LED_NUMFLASH_STARTED        1
 #define LED_NUMFLASH_OK             2
 #define LED_NUMFLASH_ENDED_OK       3
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <msp430.h>
+
+#include "tps65217.h"
+#include "sched.h"
+#include "i2cq.h"
+
+static struct i2cq_req *head, *tail;
+static uint8_t msg;		// Messages of head sent so far
+static unsigned int result;	// Their combined result
+
+void i2cq_post(struct i2cq_req *r)
+{
+	if (r->queued) {
+		r->queued = 2;
+		return;
+	}
+	r->queued = 1;
+	r->next = 0;
+	if (tail)
+		tail->next = r;
+	else
+		head = r;
+	tail = r;
+	sched_post(TASK_I2C);
+}
+
+int i2cq_busy(void)
+{
+	return head != 0;
+}
+
+int i2cq_step(void)
+{
+	struct i2cq_req *r = head;
+	uint8_t n;
+
+	if (!r)
+		return 0;
+	// Protected writes are (password, value) pairs, chained with
+	// repeated STARTs; the bus waits with SCL low between slices
+	n = r->op == I2CQ_WRPW2 ? 4 : r->op == I2CQ_WRPW1 ? 2 : 1;
+	if (r->op == I2CQ_RD)
+		result |= swi2cmst_wr1rd1_rs(TPS65217_SLAVEADDR, r->reg, &r->val);
+	else if (n > 1 && !(msg & 1))
+		result |= swi2cmst_wr2_rs(TPS65217_SLAVEADDR, TPS65217_PASSWORD,
+					  TPS65217_PASSWORD_VALUE ^ r->reg);
+	else
+		result |= swi2cmst_wr2_rs(TPS65217_SLAVEADDR, r->reg, r->val);
+	if (++msg < n)
+		return 1;
+
+	r->result = swi2cmst_end(result);
+	result = 0;
+	msg = 0;
+	head = r->next;
+	if (!head)
+		tail = 0;
+	if (r->queued == 2) {
+		r->queued = 0;
+		i2cq_post(r);
+	} else {
+		r->queued = 0;
+	}
+	if (r->done)
+		r->done(r);
+	return head != 0;
+}
@@ -0,0 +1,33 @@
+/* PMIC register accesses queued from the main loop and carried out by
+   TASK_I2C, one I2C message per slice, so JTAG and USB get their turn
+   between the messages of a protected write.
+
+   Requests belong to the caller (usually static) and must be left
+   alone while queued. done, if set, runs from the task after the last
+   message, with result filled in (and val, for a read). Posting a
+   request that is still queued runs it once more after it completes,
+   so the last post always wins.
+
+   Main loop only. Once the queue is in use, the synchronous
+   tps65217_* calls would cut into its transfers; they are for boot. */
+
+enum i2cq_op {
+	I2CQ_WR,	/* reg = val */
+	I2CQ_WRPW1,	/* reg = val, level 1 password protected */
+	I2CQ_WRPW2,	/* reg = val, level 2 password protected */
+	I2CQ_RD,	/* val = reg */
+};
+
+struct i2cq_req {
+	uint8_t op, reg, val;
+	uint8_t result;		/* TPS65217_OK or an error */
+	void (*done)(struct i2cq_req *);
+	struct i2cq_req *next;
+	uint8_t queued;		/* 1 queued, 2 posted again meanwhile */
+};
+
+void i2cq_post(struct i2cq_req *r);
+/* Nonzero while anything is queued */
+int i2cq_busy(void);
+/* TASK_I2C: send the next message, nonzero while more are queued */
+int i2cq_step(void);
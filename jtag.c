@@ -3,6 +3,8 @@
 #include <stdbool.h>
 
 #include "jtag.h"
+#include "stats.h"
+#include "trace.h"
 
 /* Support functions for JTAG via gpio and USCI SPI
    Intended for ORSoC Cyclone V board. Since the Cyclone V is capable of
@@ -104,6 +106,76 @@
 
 #define USE_USCI 1
 
+/* Active serial and passive serial use the same lines as on the
+   Blaster's 10 pin header: DCLK on TCK, nCONFIG on TMS, ASDI/DATA0 on
+   TDI and CONF_DONE on TDO. nCS and nCE need pins of their own, driven
+   only while OE is set, and so does DATAOUT, which bit mode reads back
+   in bit 1. While nCS is low, byte mode reads DATAOUT instead of TDO.
+   As that is not the USCI's SOMI, such reads are bit banged; writes
+   (programming data, PS configuration) still go through the USCI.
+
+   ORDB3A has no pins left for these, its FPGA is wired for JTAG only,
+   so there nCS and nCE are just remembered and DATAOUT reads 1. */
+#if OLIMEXINO_5510
+#define AS_PINS 1
+#define AS_OUT P1OUT	// Arduino D2..D4
+#define AS_DIR P1DIR
+#define AS_REN P1REN
+#define AS_IN P1IN
+#define AS_NCS BIT0
+#define AS_NCE BIT1
+#define AS_DATAOUT BIT2
+#else
+#define AS_PINS 0
+#endif
+
+#define BLASTER_OE BIT5
+#define BLASTER_NCS BIT3
+#define BLASTER_NCE BIT2
+
+/* Byte mode reads come from DATAOUT, so cannot use the USCI. Writes,
+   without the read flag, can. */
+static inline bool as_dataout(void) {
+	return AS_PINS && usb_jtag_state.read &&
+		(usb_jtag_state.pins & (BLASTER_OE|BLASTER_NCS)) == BLASTER_OE;
+}
+
+#if AS_PINS
+static void as_set_pins(uint8_t fromhost) {
+	uint8_t set=0;
+	if (fromhost & BLASTER_NCS)
+		set |= AS_NCS;
+	if (fromhost & BLASTER_NCE)
+		set |= AS_NCE;
+	if (fromhost & BLASTER_OE) {
+		AS_OUT = (AS_OUT & ~(AS_NCS|AS_NCE)) | set;
+		AS_REN &= ~(AS_NCS|AS_NCE);
+		AS_DIR |= AS_NCS|AS_NCE;
+	} else {  // Released, pulled up
+		AS_DIR &= ~(AS_NCS|AS_NCE);
+		AS_OUT |= AS_NCS|AS_NCE;
+		AS_REN |= AS_NCS|AS_NCE;
+	}
+}
+
+/* jtag_shift_bits for AS reads: TMS is left alone, DATAOUT sampled */
+static uint8_t as_shift_byte(uint8_t asdi) {
+	uint8_t dataout=0, len=8;
+
+	while (len--) {
+		if (asdi&1)
+			P4OUT |= BIT1;
+		else
+			P4OUT &= ~BIT1;
+		dataout = (dataout>>1) | (AS_IN&AS_DATAOUT?0x80:0x00);
+		P4OUT |= BIT3;
+		asdi >>= 1;
+		P4OUT &= ~BIT3;
+	}
+	return dataout;
+}
+#endif
+
 void jtag_init() {
 	/* We need to fall back to GPIO for bit or TMS transfers */
 #if OLIMEXINO_5510
@@ -134,9 +206,16 @@ void jtag_init() {
 	//UCB1STAT = 0;
 	UCB1IE = 0;
 	UCB1CTL1 = UCSSEL1 | UCSWRST; // use ACLK, keep in reset until used
+#endif
+#if AS_PINS
+	AS_DIR &= ~AS_DATAOUT;
+	AS_OUT |= AS_DATAOUT;
+	AS_REN |= AS_DATAOUT;
+	as_set_pins(BLASTER_NCS|BLASTER_NCE);
 #endif
 	usb_jtag_state.bytes_to_shift = 0;
 	usb_jtag_state.read = 0;
+	usb_jtag_state.pins = BLASTER_NCS|BLASTER_NCE;
 }
 
 /* Shift up to 8 bits on both TMS and TDI, reading TDO.
@@ -181,6 +260,22 @@ uint8_t jtag_shift_bits(uint8_t tdi, uint8_t tms, uint8_t len) {
 	return tdo;
 }
 
+static inline void jtag_set_tms(uint8_t tms) {
+#if ORDB3A
+	if (tms)
+		P4OUT |= BIT0;
+	else
+		P4OUT &= ~BIT0;
+#elif OLIMEXINO_5510
+	if (tms)
+		PJOUT |= BIT0;
+	else
+		PJOUT &= ~BIT0;
+#else
+#error Unknown board!
+#endif
+}
+
 #if USE_USCI
 void jtag_spi_on(void) {
 	/* Enable SPI function */
@@ -197,53 +292,103 @@ void jtag_spi_off(void) {
 	UCB1CTL1 = UCSSEL1 | UCSWRST;  // Halt SPI unit
 }
 
-/* Shift large amounts of data at top speed, uses SPI and DMA functions
-   Uses DMA1 for Tx and DMA0 for Rx, both set up here
+/* Shift large amounts of data at top speed, uses the SPI function.
+   Polled rather than by DMA, because of erratum DMA10: the DMA unit
+   can break transfers, making access to the USB module unreliable.
    Buffers may be the same, but must exist
  */
 void jtag_shift_bytes_start(const uint8_t *bytes_out, uint8_t *bytes_in, uint16_t len) {
+	TRACE(TRACE_SPI_START, len);
 	jtag_spi_on();
-#define ERRATUM_DMA10 1
-#if ERRATUM_DMA10
-		// Avoiding DMA mode for the moment because of erratum DMA10
-		// Accessing USB module becomes unreliable because DMA unit can break transfers
 	while (len--) {
 		UCB1TXBUF=*bytes_out++;
 		while (!(UCB1IFG & UCRXIFG))
 			/* wait */;
 		*bytes_in++=UCB1RXBUF;
 	}
-#else
-	/* Set DMA up to feed SPI */
-	DMA0CTL = DMA1CTL = 0;  // disable both channels
-	DMACTL0 = DMA1TSEL__USCIB1TX | DMA0TSEL__USCIB1RX;  // Trigger source for both DMAs
-	DMA1SA = (uintptr_t)bytes_out;
-	DMA1DA = (uintptr_t)&UCB1TXBUF;
-	DMA1SZ = len;
-	DMA0SA = (uintptr_t)&UCB1RXBUF;
-	DMA0DA = (uintptr_t)bytes_in;
-	DMA0SZ = len;
-	// set Rx up before Tx
-	DMA0CTL = DMADT_0 | DMADSTINCR_3 | DMADSTBYTE | DMASRCBYTE | DMALEVEL |
-		/* DMAIE | */ DMAEN;
-	DMA1CTL = DMADT_0 | DMASRCINCR_3 | DMADSTBYTE | DMASRCBYTE | DMALEVEL | DMAEN;
-
-	/* DMA channels auto-disable when done, but P4SEL and UCB1CTL1 need to be reset */
-	/* Could enable an interrupt from DMA0 to report finish */
-#endif
 }
 
 void jtag_shift_bytes_finish() {
-#ifndef ERRATUM_DMA10
-	/* Await the transfer to finish then switch back to GPIO */
-	while ((DMA0CTL|DMA1CTL) & DMAEN) {
-		/* Wait for DMA to finish */;
-	}
-#endif
 	jtag_spi_off();
+	TRACE(TRACE_SPI_END, 0);
 }
 #endif // USE_USCI
 
+/* Shift bits from TMS and TDI vectors, LSB first, storing TDO. Runs of
+   whole bytes where TMS holds still go through the USCI, the rest (TMS
+   edges, the odd bits at the end) through jtag_shift_bits. */
+void jtag_shift_vector(const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo, uint16_t bits) {
+	while (bits) {
+		uint8_t t=*tms, len;
+#if USE_USCI
+		if (bits>=8 && (t==0x00 || t==0xff)) {
+			uint16_t n=1;
+			while (n<bits/8 && tms[n]==t)
+				n++;
+			jtag_set_tms(t);
+			jtag_shift_bytes_start(tdi, tdo, n);
+			jtag_shift_bytes_finish();
+			stats.jtag_spi_bits+=n*8;
+			tms+=n;
+			tdi+=n;
+			tdo+=n;
+			bits-=n*8;
+			continue;
+		}
+#endif
+		len = bits<8 ? bits : 8;
+		*tdo++ = jtag_shift_bits(*tdi++, t, len) >> (8-len);
+		stats.jtag_gpio_bits+=len;
+		tms++;
+		bits-=len;
+	}
+}
+
+/* Shift bits of TDI from buf with TMS low, storing TDO over them. With
+   exit, TMS goes high on the last bit, leaving Shift-DR or Shift-IR.
+   Whole bytes before that go through the USCI. */
+void jtag_shift_tdi(uint8_t *buf, uint16_t bits, uint8_t exit) {
+	uint16_t n=bits/8;
+	uint8_t len;
+
+	if (exit && n && !(bits&7))
+		n--;  // The last whole byte has the TMS edge
+	if (n) {
+		jtag_set_tms(0);
+#if USE_USCI
+		jtag_shift_bytes_start(buf, buf, n);
+		jtag_shift_bytes_finish();
+		stats.jtag_spi_bits+=n*8;
+#else
+		uint16_t i;
+		for (i=0; i<n; i++)
+			buf[i] = jtag_shift_bits(buf[i], 0, 8);
+		stats.jtag_gpio_bits+=n*8;
+#endif
+	}
+	len = bits-n*8;
+	if (len) {
+		buf[n] = jtag_shift_bits(buf[n], exit ? 1<<(len-1) : 0, len) >> (8-len);
+		stats.jtag_gpio_bits+=len;
+	}
+}
+
+/* TCK period for USCI shifts, in ns. Rounded up to a divisor of ACLK
+   (24MHz), no faster than the 12MHz Blaster default, which 0 restores.
+   Returns the period set. Bit banged shifts run at their own pace. */
+uint32_t jtag_set_period(uint32_t ns) {
+	uint16_t div;
+
+	if (ns > 0xffffUL*1000/24)
+		div = 0xffff;
+	else
+		div = (ns*24+999)/1000;
+	if (div < 2)
+		div = 2;
+	UCB1BRW = div;  // USCI is held in reset between shifts
+	return div*1000UL/24;
+}
+
 struct usbblaster_state /* {
 	//uint8_t *bytes_in, *bytes_out;
 	uint8_t bytes_to_shift, read;
@@ -256,6 +401,10 @@ uint8_t usbblaster_byte(uint8_t fromhost) {
 	if (usb_jtag_state.bytes_to_shift) {
 		uint8_t tms;
 		usb_jtag_state.bytes_to_shift--;
+#if AS_PINS
+		if (as_dataout())
+			return as_shift_byte(fromhost);
+#endif
 #if ORDB3A
 		tms = P4OUT&BIT0;
 #elif OLIMEXINO_5510
@@ -270,12 +419,19 @@ uint8_t usbblaster_byte(uint8_t fromhost) {
 			usb_jtag_state.bytes_to_shift = fromhost&0x3f;
 			return 0;
 		} else {
-			uint8_t mask=0xff, set=0x00, tdo;
-			if (fromhost & BIT0)  // TCK
+			uint8_t mask=0xff, set=0x00, tdo, dataout;
+			usb_jtag_state.pins = fromhost;
+#if AS_PINS
+			as_set_pins(fromhost);
+			dataout = AS_IN&AS_DATAOUT;
+#else
+			dataout = 1;
+#endif
+			if (fromhost & BIT0)  // TCK/DCLK
 				set |= BIT3;
 			else
 				mask &= ~BIT3;
-			if (fromhost & BIT4)  // TDI
+			if (fromhost & BIT4)  // TDI/ASDI
 				set |= BIT1;
 			else
 				mask &= ~BIT1;
@@ -286,7 +442,7 @@ uint8_t usbblaster_byte(uint8_t fromhost) {
 			else
 				PJOUT &= ~BIT0;
 #elif ORDB3A
-			if (fromhost & BIT1)  // TMS
+			if (fromhost & BIT1)  // TMS/nCONFIG
 				set |= BIT0;
 			else
 				mask &= ~BIT0;
@@ -303,7 +459,7 @@ uint8_t usbblaster_byte(uint8_t fromhost) {
 				PJOUT &= ~BIT3;
 #endif
 
-			return tdo?1:0;  // TDO
+			return (dataout?2:0) | (tdo?1:0);  // DATAOUT, TDO/CONF_DONE
 		}
 	}
 }
@@ -313,14 +469,20 @@ uint8_t usbblaster_byte(uint8_t fromhost) {
 int usbblaster_process_buffer(uint8_t *buf, int len) {
 	int i=0, o=0;
 
+	TRACE(TRACE_BLASTER_START, len);
 	while (i<len) {
 		uint8_t bts=usb_jtag_state.bytes_to_shift, ret;
 
 #if USE_USCI
-		if (bts==0)
+		if (bts==0 || as_dataout())
 #endif
 		{  // bitbang / command byte
-			ret=usbblaster_byte(buf[i++]);
+			uint8_t b=buf[i++];
+			if (bts)
+				stats.jtag_gpio_bits+=8;
+			else if (!(b&0x80) && (b&BIT0))
+				stats.jtag_gpio_bits++;  // Bit mode, counted at TCK high
+			ret=usbblaster_byte(b);
 			if (usb_jtag_state.read &&
 			    !(usb_jtag_state.bytes_to_shift && !bts)) {
 				buf[o++]=ret;
@@ -331,6 +493,7 @@ int usbblaster_process_buffer(uint8_t *buf, int len) {
 			ret=len-i>bts ? bts : len-i;  // Size of data that can be shifted directly
 			jtag_shift_bytes_start(buf+i, buf+o, ret);
 			jtag_shift_bytes_finish();
+			stats.jtag_spi_bits+=ret*8;
 			if (usb_jtag_state.read)
 				o+=ret;
 			i+=ret;
@@ -339,6 +502,7 @@ int usbblaster_process_buffer(uint8_t *buf, int len) {
 #endif
 	}
 
+	TRACE(TRACE_BLASTER_END, o);
 	return o;
 }
 
@@ -1,6 +1,7 @@
 extern struct usbblaster_state {
 	//uint8_t *bytes_in, *bytes_out;
 	uint8_t bytes_to_shift, read;
+	uint8_t pins;	// Last bit mode byte, for OE, nCS and nCE
 } usb_jtag_state;
 
 // This implements a lot of the usb blaster protocol (cpld side). 
@@ -9,6 +10,13 @@ uint8_t usbblaster_byte(uint8_t fromhost);
 void jtag_init(void);
 int usbblaster_process_buffer(uint8_t *buf, int len);
 
+// Vector shifts for XVC (xvc.c)
+void jtag_shift_vector(const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo, uint16_t bits);
+uint32_t jtag_set_period(uint32_t ns);
+// Batched shifts for the CDC command set (rbb.c)
+uint8_t jtag_shift_bits(uint8_t tdi, uint8_t tms, uint8_t len);
+void jtag_shift_tdi(uint8_t *buf, uint16_t bits, uint8_t exit);
+
 // libxsvf JTAG interface
 struct libxsvf_host;
 int pulse_tck(struct libxsvf_host *h, int tms, int tdi, int tdo, int rmask, int sync);
@@ -69,6 +69,9 @@ extern WORD wUsbHidEventMask;
 BOOL PHDCToHostFromBuffer(BYTE);
 BOOL PHDCToBufferFromHost(BYTE);
 BOOL PHDCIsReceiveInProgress(BYTE);
+
+BOOL MSCToHostFromBuffer(VOID);
+BOOL MSCFromHostToBuffer(VOID);
 /*----------------------------------------------------------------------------+
 | General Subroutines                                                         |
 +----------------------------------------------------------------------------*/
@@ -169,6 +172,9 @@ __interrupt VOID iUsbInterruptHandler(VOID)
       bWakeUp = CdcToHostFromBuffer(CDC0_INTFNUM);
       break;
     case USBVECINT_INPUT_ENDPOINT6:
+#ifdef _MSC_
+      bWakeUp = MSCToHostFromBuffer();
+#endif
       break;
     case USBVECINT_INPUT_ENDPOINT7:
       break;
@@ -222,6 +228,9 @@ __interrupt VOID iUsbInterruptHandler(VOID)
       }
       break;
     case USBVECINT_OUTPUT_ENDPOINT6:
+#ifdef _MSC_
+      bWakeUp = MSCFromHostToBuffer();
+#endif
       break;
     case USBVECINT_OUTPUT_ENDPOINT7:
       break;
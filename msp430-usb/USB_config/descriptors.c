@@ -38,8 +38,19 @@
 #include <USB_API/USB_Common/defMSP430USB.h>
 #include <USB_API/USB_Common/usb.h>              // USB-specific Data Structures
 #include "descriptors.h"
+#include <stdint.h>
+#include <string.h>
+#include <nand_ordb3.h>
+#include <stats.h>
+#include <trace.h>
+#include <boottime.h>
+#include <xvc.h>
 #include <USB_API/USB_CDC_API/UsbCdc.h>
 #include <USB_API/USB_HID_API/UsbHidReq.h>
+#ifdef _MSC_
+#include <USB_API/USB_MSC_API/UsbMscScsi.h>
+#include <USB_API/USB_MSC_API/UsbMscReq.h>
+#endif
 
 WORD const report_desc_size[HID_NUM_INTERFACES] =
 {
@@ -268,8 +279,42 @@ const struct abromConfigurationDescriptorGroup abromConfigurationDescriptorGroup
         }
 
         /* end CDC[0]*/
-    }
+    },
+    /******************************************************* end of CDC**************************************/
+
+#ifdef _MSC_
+    /******************************************************* start of MSC*************************************/
+    {
+        /* start MSC[0] - boot image as a small FAT volume, see nand_msc.c */
+        {
+            SIZEOF_INTERFACE_DESCRIPTOR,        // bLength
+            DESC_TYPE_INTERFACE,                // bDescriptorType: 4
+            MSC0_DATA_INTERFACE,                // bInterfaceNumber
+            0x00,                               // bAlternateSetting
+            2,                                  // bNumEndpoints
+            0x08,                               // bInterfaceClass: Mass Storage
+            0x06,                               // bInterfaceSubClass: SCSI transparent
+            0x50,                               // bInterfaceProtocol: Bulk-only transport
+            INTF_STRING_INDEX + 0,              // iInterface
+
+            SIZEOF_ENDPOINT_DESCRIPTOR,         // bLength
+            DESC_TYPE_ENDPOINT,                 // bDescriptorType
+            MSC0_INEP_ADDR,                     // bEndpointAddress
+            EP_DESC_ATTR_TYPE_BULK,             // bmAttributes: Bulk
+            0x40, 0x00,                         // wMaxPacketSize, 64 bytes
+            0,                                  // bInterval: ignored for bulk transfer
 
+            SIZEOF_ENDPOINT_DESCRIPTOR,         // bLength
+            DESC_TYPE_ENDPOINT,                 // bDescriptorType
+            MSC0_OUTEP_ADDR,                    // bEndpointAddress
+            EP_DESC_ATTR_TYPE_BULK,             // bmAttributes: Bulk
+            0x40, 0x00,                         // wMaxPacketSize, 64 bytes
+            0                                   // bInterval: ignored for bulk transfer
+        }
+        /* end MSC[0]*/
+    }
+    /******************************************************* end of MSC**************************************/
+#endif
 
 };
 /*-----------------------------------------------------------------------------+
@@ -385,8 +430,37 @@ const struct tUsbHandle stUsbHandle[]=
         IEP2_X_BUFFER_ADDRESS,
         IEP2_Y_BUFFER_ADDRESS
     },
+#ifdef _MSC_
+    {
+        MSC0_INEP_ADDR,
+        MSC0_OUTEP_ADDR,
+        5,   // edb index
+        MSC_CLASS,
+        0,
+        0,
+        OEP6_X_BUFFER_ADDRESS,
+        OEP6_Y_BUFFER_ADDRESS,
+        IEP6_X_BUFFER_ADDRESS,
+        IEP6_Y_BUFFER_ADDRESS
+    },
+#endif
 
 };
+#ifdef _MSC_
+struct config_struct USBMSC_config = {
+    {
+        {
+            0x00,                       // The number of this LUN
+            0x00,                       // PDT: direct access block device
+            0x80,                       // Removable
+            "ORSoC   ",                 // T10 vendor ID
+            "ORDB3A boot     ",         // T10 product ID
+            "0200"                      // T10 revision
+        }
+    }
+};
+#endif
+
 //-------------DEVICE REQUEST LIST---------------------------------------------
 extern void Report_NAND(int ifnum);
 /* Ignore FTDI specific device set requests (such as modes and baud rates) */
@@ -398,9 +472,11 @@ BYTE usbSetVendor(VOID) {
 
 extern __no_init tDEVICE_REQUEST __data16 tSetupPacket;
 
-/* FTDI latency timer setting */
+/* FTDI latency timer setting. It also paces partial Blaster packets,
+   so 0 (which would stop the timer) counts as 1ms like on the FT245. */
 BYTE usbSetLatencyTimer(VOID) {
-	TA1CCR0 = tSetupPacket.wValue*(32768/1024/2);
+	BYTE ms = tSetupPacket.wValue ? tSetupPacket.wValue : 1;
+	TA1CCR0 = ms*(32768/1024/2);
         usbSendZeroLengthPacketOnIEP0();
 	//Report_NAND(HID0_REPORT_INTERFACE); // Abuse this part of initialization to report NAND type
 	return (FALSE);
@@ -413,6 +489,74 @@ BYTE usbGetLatencyTimer(VOID) {
 	return (FALSE);
 }
 
+/* Background FPGA configuration progress, struct fpga_config_status */
+BYTE usbGetFpgaConfig(VOID) {
+	usbClearOEP0ByteCount();            //for status stage
+	wBytesRemainingOnIEP0 = sizeof fpga_config;
+	usbSendDataPacketOnEP0((PBYTE)&fpga_config);
+	return (FALSE);
+}
+
+/* Event and throughput counters, struct stats */
+BYTE usbGetStats(VOID) {
+	static struct stats copy;	// Counters move while EP0 sends
+	unsigned short bGIE = __get_SR_register() & GIE;
+
+	__disable_interrupt();
+	copy = stats;
+	__bis_SR_register(bGIE);
+	usbClearOEP0ByteCount();            //for status stage
+	wBytesRemainingOnIEP0 = sizeof copy;
+	usbSendDataPacketOnEP0((PBYTE)&copy);
+	return (FALSE);
+}
+BYTE usbClearStats(VOID) {
+	unsigned short bGIE = __get_SR_register() & GIE;
+
+	__disable_interrupt();
+	memset(&stats, 0, sizeof stats);
+	__bis_SR_register(bGIE);
+	usbSendZeroLengthPacketOnIEP0();
+	return (FALSE);
+}
+
+/* Interface A protocol: wValue 1 for XVC, 0 for the Blaster */
+BYTE usbSetXvc(VOID) {
+	xvc_enable(tSetupPacket.wValue!=0);
+	usbSendZeroLengthPacketOnIEP0();
+	return (FALSE);
+}
+
+/* Boot phase timing, struct boottime */
+BYTE usbGetBoottime(VOID) {
+	usbClearOEP0ByteCount();            //for status stage
+	wBytesRemainingOnIEP0 = sizeof boottime;
+	usbSendDataPacketOnEP0((PBYTE)&boottime);
+	return (FALSE);
+}
+
+#ifdef USE_TRACE
+/* Event timeline, struct trace_buf. Recording stops so it holds still
+   while EP0 sends it. */
+BYTE usbGetTrace(VOID) {
+	trace.stopped = 1;
+	usbClearOEP0ByteCount();            //for status stage
+	wBytesRemainingOnIEP0 = sizeof trace;
+	usbSendDataPacketOnEP0((PBYTE)&trace);
+	return (FALSE);
+}
+BYTE usbRestartTrace(VOID) {
+	unsigned short bGIE = __get_SR_register() & GIE;
+
+	__disable_interrupt();
+	trace.head = 0;
+	trace.stopped = 0;
+	__bis_SR_register(bGIE);
+	usbSendZeroLengthPacketOnIEP0();
+	return (FALSE);
+}
+#endif
+
 extern __no_init tEDB0 tEndPoint0DescriptorBlock;
 BYTE usbDisconnectThenBSL(VOID) {
 	volatile long i;
@@ -450,6 +594,34 @@ const tDEVICE_REQUEST_COMPARE tUsbRequestList[] =
 	USB_REQ_TYPE_INPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, 10,
 	0xff,0xff, 0xff,0xff, 0xff,0xff,
 	0xc0, &usbGetLatencyTimer,
+	/* Our own: FPGA configuration progress */
+	USB_REQ_TYPE_INPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, FPGA_CONFIG_REQUEST,
+	0xff,0xff, 0xff,0xff, 0xff,0xff,
+	0xc0, &usbGetFpgaConfig,
+	/* Our own: counters */
+	USB_REQ_TYPE_INPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, STATS_REQUEST,
+	0xff,0xff, 0xff,0xff, 0xff,0xff,
+	0xc0, &usbGetStats,
+	USB_REQ_TYPE_OUTPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, STATS_REQUEST,
+	0xff,0xff, 0xff,0xff, 0xff,0xff,
+	0xc0, &usbClearStats,
+	/* Our own: boot timing */
+	USB_REQ_TYPE_INPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, BOOTTIME_REQUEST,
+	0xff,0xff, 0xff,0xff, 0xff,0xff,
+	0xc0, &usbGetBoottime,
+	/* Our own: XVC on interface A */
+	USB_REQ_TYPE_OUTPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, XVC_REQUEST,
+	0xff,0xff, 0xff,0xff, 0xff,0xff,
+	0xc0, &usbSetXvc,
+#ifdef USE_TRACE
+	/* Our own: event timeline */
+	USB_REQ_TYPE_INPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, TRACE_REQUEST,
+	0xff,0xff, 0xff,0xff, 0xff,0xff,
+	0xc0, &usbGetTrace,
+	USB_REQ_TYPE_OUTPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, TRACE_REQUEST,
+	0xff,0xff, 0xff,0xff, 0xff,0xff,
+	0xc0, &usbRestartTrace,
+#endif
 	/* Vendor specific requests - sent for FTDI chip */
 	USB_REQ_TYPE_OUTPUT | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE, 0,
 	0,0, 0,0, 0,0,
@@ -526,6 +698,25 @@ const tDEVICE_REQUEST_COMPARE tUsbRequestList[] =
     0x00,0x00,                                 // No further data
     0xcf,&usbSetControlLineState,
 
+#ifdef _MSC_
+    //---- MSC Class Requests -----//
+    // Reset MSC
+    USB_REQ_TYPE_OUTPUT | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+    USB_MSC_RESET_BULK,
+    0x00,0x00,                                 // always zero
+    MSC0_DATA_INTERFACE,0x00,
+    0x00,0x00,                                 // No further data
+    0xff,&USBMSC_reset,
+
+    // Get Max Lun
+    USB_REQ_TYPE_INPUT | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+    USB_MSC_GET_MAX_LUN,
+    0x00,0x00,                                 // always zero
+    MSC0_DATA_INTERFACE,0x00,
+    0x01,0x00,                                 // Size of Structure (data length)
+    0xff,&Get_MaxLUN,
+#endif
+
 
     //---- USB Standard Requests -----//
     // clear device feature
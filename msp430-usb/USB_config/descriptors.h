@@ -48,6 +48,9 @@ extern "C"
 //***********************************************************************************************
 #define _CDC_          // Needed for CDC interface
 #define _HID_          // Needed for HID interface
+#ifdef USE_MSC
+#define _MSC_          // Boot image as a mass storage device (make MSC=1)
+#endif
 //***********************************************************************************************
 // CONFIGURATION CONSTANTS
 //***********************************************************************************************
@@ -79,9 +82,10 @@ extern "C"
 /* We do not use HID, so need no report descriptors. Nor have we activated CDC yet. */
 #define DESCRIPTOR_TOTAL_LENGTH             (SIZEOF_CONFIG_DESCRIPTOR+	\
 					     2*(SIZEOF_INTERFACE_DESCRIPTOR+2*SIZEOF_ENDPOINT_DESCRIPTOR)+ /* ftdi */ \
-					     SIZEOF_CDC_INTERFACE_DESCRIPTOR)
+					     SIZEOF_CDC_INTERFACE_DESCRIPTOR+	\
+					     MSC_NUM_INTERFACES*(SIZEOF_INTERFACE_DESCRIPTOR+2*SIZEOF_ENDPOINT_DESCRIPTOR))
 	// wTotalLength, This is the sum of configuration descriptor length  + CDC descriptor length  + HID descriptor length
-#define USB_NUM_INTERFACES                  4    // Number of implemented interfaces.
+#define USB_NUM_INTERFACES                  (4+MSC_NUM_INTERFACES)    // Number of implemented interfaces.
 
 /* We have modified the HID stack to support use for FTDI style bulk channels */
 #define HID0_REPORT_INTERFACE              0              // Report interface number of HID0
@@ -98,20 +102,34 @@ extern "C"
 #define CDC0_OUTEP_ADDR                    0x05           // Output Endpoint Address of CDC0
 #define CDC0_INEP_ADDR                     0x85           // Input Endpoint Address of CDC0
 
+#define MSC0_DATA_INTERFACE                4              // Data interface number of MSC0
+#define MSC0_OUTEP_ADDR                    0x06           // Output Endpoint Address of MSC0
+#define MSC0_INEP_ADDR                     0x86           // Input Endpoint Address of MSC0
+
 #define CDC_NUM_INTERFACES                   1           //  Total Number of CDCs implemented. should set to 0 if there are no CDCs implemented.
 #define HID_NUM_INTERFACES                   2           //  Total Number of HIDs implemented. should set to 0 if there are no HIDs implemented.
+#ifdef _MSC_
+#define MSC_NUM_INTERFACES                   1           //  Total Number of MSCs implemented. should set to 0 if there are no MSCs implemented.
+#else
 #define MSC_NUM_INTERFACES                   0           //  Total Number of MSCs implemented. should set to 0 if there are no MSCs implemented.
+#endif
 #define PHDC_NUM_INTERFACES                  0           //  Total Number of PHDCs implemented. should set to 0 if there are no PHDCs implemented.
 // Interface numbers for the implemented CDSs and HIDs, This is to use in the Application(main.c) and in the interupt file(UsbIsr.c).
 #define HID0_INTFNUM                HID0_REPORT_INTERFACE
 #define FLASH_INTFNUM		    HID1_REPORT_INTERFACE
 #define CDC0_INTFNUM                CDC0_COMM_INTERFACE
+#define MSC0_INTFNUM                3    // Index into stUsbHandle, not the interface number
 #define MSC_MAX_LUN_NUMBER                   1           // Maximum number of LUNs supported
 
 #define PUTWORD(x)      ((x)&0xFF),((x)>>8)
 
+#ifdef _MSC_
+#define USB_OUTEP_INT_EN BIT0 | BIT2 | BIT4 | BIT5 | BIT6
+#define USB_INEP_INT_EN BIT0 | BIT1 | BIT3 | BIT4 | BIT5 | BIT6
+#else
 #define USB_OUTEP_INT_EN BIT0 | BIT2 | BIT4 | BIT5
 #define USB_INEP_INT_EN BIT0 | BIT1 | BIT3 | BIT4 | BIT5
+#endif
 // MCLK frequency of MCU, in Hz
 // For running higher frequencies the Vcore voltage adjustment may required.
 // Please refer to Data Sheet of the MSP430 device you use
@@ -362,10 +380,6 @@ struct  abromConfigurationDescriptorGroup
 {
     /* Generic part of config descriptor */
     const struct abromConfigurationDescriptorGenric abromConfigurationDescriptorGenric;
-#ifdef _MSC_
-    /* MSC descriptor structure */
-    const struct abromConfigurationDescriptorMsc stMsc[MSC_NUM_INTERFACES];
-#endif
 #ifdef _HID_
     /* HID descriptor structure */
     const struct abromConfigurationDescriptorHid stHid[HID_NUM_INTERFACES];
@@ -374,6 +388,10 @@ struct  abromConfigurationDescriptorGroup
     /* CDC descriptor structure */
     const struct abromConfigurationDescriptorCdc stCdc[CDC_NUM_INTERFACES];
 #endif
+#ifdef _MSC_
+    /* MSC descriptor structure, last to keep interface numbers in order */
+    const struct abromConfigurationDescriptorMsc stMsc[MSC_NUM_INTERFACES];
+#endif
 #ifdef _PHDC_
 /* PDC descriptor structure */
     const struct abromConfigurationDescriptorPhdc stPhdc[PHDC_NUM_INTERFACES];
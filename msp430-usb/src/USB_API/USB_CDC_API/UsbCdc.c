@@ -869,6 +869,12 @@ BYTE Handler_SetLineCoding (VOID)
         (ULONG)abUsbRequestIncomingData[2] << 16 |
         (ULONG)
         abUsbRequestIncomingData[1] << 8 | abUsbRequestIncomingData[0];
+    CdcControl[INTFNUM_OFFSET(tSetupPacket.wIndex)].bStopBits =
+        abUsbRequestIncomingData[4];
+    CdcControl[INTFNUM_OFFSET(tSetupPacket.wIndex)].bParity =
+        abUsbRequestIncomingData[5];
+    CdcControl[INTFNUM_OFFSET(tSetupPacket.wIndex)].bDataBits =
+        abUsbRequestIncomingData[6];
     bWakeUp =
         USBCDC_handleSetLineCoding(tSetupPacket.wIndex,
             CdcControl[INTFNUM_OFFSET(tSetupPacket.wIndex)].lBaudrate);
@@ -876,6 +882,15 @@ BYTE Handler_SetLineCoding (VOID)
     return (bWakeUp);
 }
 
+//----------------------------------------------------------------------------
+
+VOID USBCDC_getLineFormat (BYTE intfNum, BYTE* stopBits, BYTE* parity, BYTE* dataBits)
+{
+    *stopBits = CdcControl[INTFNUM_OFFSET(intfNum)].bStopBits;
+    *parity = CdcControl[INTFNUM_OFFSET(intfNum)].bParity;
+    *dataBits = CdcControl[INTFNUM_OFFSET(intfNum)].bDataBits;
+}
+
 #ifdef BRIDGE_CDC_PRESENT
 
 BYTE USBCDC_setupDMA_Bridge()
@@ -152,6 +152,13 @@ void USBCDC_setCTS(BYTE state);
  */
 BYTE USBCDC_handleSetLineCoding (BYTE intfNum, ULONG lBaudrate);
 
+/*
+ * The rest of the line coding from the last SetLineCoding request, coded as in the request
+ * (stop bits 0/1/2 = 1/1.5/2, parity 0-4 = none/odd/even/mark/space). For use by
+ * USBCDC_handleSetLineCoding.
+ */
+VOID USBCDC_getLineFormat (BYTE intfNum, BYTE* stopBits, BYTE* parity, BYTE* dataBits);
+
 /*
  * This event indicates that a SetControlLineState request was received from the host. 
  * Basically new RTS and DTR states have been sent. Bit 0 of lineState is DTR and Bit 1 is RTS.
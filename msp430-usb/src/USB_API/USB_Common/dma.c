@@ -58,16 +58,43 @@ VOID * memcpyDMA0 (VOID * dest, const VOID * source, size_t count);
 VOID * memcpyDMA1 (VOID * dest, const VOID * source, size_t count);
 VOID * memcpyDMA2 (VOID * dest, const VOID * source, size_t count);
 
+//copies shorter than this are done by the CPU, the DMA setup costs more
+#define DMA_MIN_COUNT 16
+
 //NOTE: this functin works only with data in the area <64k (small memory model)
+//Moves words, four at a time, when both buffers have the same alignment.
 VOID * memcpyV (VOID * dest, const VOID * source, size_t count)
 {
-    WORD i;
-    volatile BYTE bTmp;
-
-    for (i = 0; i < count; i++)
-    {
-        bTmp = *((BYTE*)source + i);
-        *((BYTE*)dest  + i) = bTmp;
+    BYTE *d = (BYTE*)dest;
+    const BYTE *s = (const BYTE*)source;
+    WORD *dw;
+    const WORD *sw;
+    WORD n;
+
+    if ((((WORD)d ^ (WORD)s) & 1) == 0){
+        if (((WORD)d & 1) && count){                        //odd start, one byte first
+            *d++ = *s++;
+            count--;
+        }
+        dw = (WORD*)d;
+        sw = (const WORD*)s;
+        for (n = count >> 1; n >= 4; n -= 4){
+            dw[0] = sw[0];
+            dw[1] = sw[1];
+            dw[2] = sw[2];
+            dw[3] = sw[3];
+            dw += 4;
+            sw += 4;
+        }
+        while (n--){
+            *dw++ = *sw++;
+        }
+        d = (BYTE*)dw;
+        s = (const BYTE*)sw;
+        count &= 1;
+    }
+    while (count--){
+        *d++ = *s++;
     }
     return (dest);
 }
@@ -111,73 +138,49 @@ VOID USB_initMemcpy (VOID)
 }
 
 //this functions starts DMA transfer to/from USB memory into/from RAM
-//Using DMA0
-//Support only for data in <64k memory area.
-VOID * memcpyDMA0 (VOID * dest, const VOID *  source, size_t count)
-{
-    if (count == 0){                                        //do nothing if zero bytes to transfer
-        return (dest);
-    }
-
-    DMA0DA = __DMA_ACCESS_REG__ dest;                       //set destination for DMAx
-    DMA0SA = __DMA_ACCESS_REG__ source;                     //set source for DMAx
-    DMA0SZ = count;                                         //how many bytes to transfer
-
-    DMA0CTL |= DMAEN;                                       //enable DMAx
-    DMA0CTL |= DMAREQ;                                      //trigger DMAx
-
-    //wait for DMA transfer finished
-    while (!(DMA0CTL & DMAIFG)) ;
-
-    DMA0CTL &= ~DMAEN;                                      //disable DMAx
-    return (dest);
-}
-
-//this functions starts DMA transfer to/from USB memory into/from RAM
-//Using DMA1
+//Using DMAn, word-wise when both buffers have the same alignment.
+//Short copies go to memcpyV. A block transfer halts the CPU until it is
+//done, so the wait for DMAIFG does not spin.
 //Support only for data in <64k memory area.
-VOID * memcpyDMA1 (VOID * dest, const VOID * source, size_t count)
-{
-    if (count == 0){                                        //do nothing if zero bytes to transfer
-        return (dest);
-    }
-
-    DMA1DA = __DMA_ACCESS_REG__ dest;                       //set destination for DMAx
-    DMA1SA = __DMA_ACCESS_REG__ source;                     //set source for DMAx
-    DMA1SZ = count;                                         //how many bytes to transfer
-
-    DMA1CTL |= DMAEN;                                       //enable DMAx
-    DMA1CTL |= DMAREQ;                                      //trigger DMAx
-
-    //wait for DMA transfer finished
-    while (!(DMA1CTL & DMAIFG)) ;
-
-    DMA1CTL &= ~DMAEN;                                      //disable DMAx
-    return (dest);
+#define MEMCPY_DMA(n)                                                       \
+VOID * memcpyDMA##n (VOID * dest, const VOID * source, size_t count)        \
+{                                                                           \
+    BYTE *d = (BYTE*)dest;                                                  \
+    const BYTE *s = (const BYTE*)source;                                    \
+                                                                            \
+    if (count < DMA_MIN_COUNT){                                             \
+        return (memcpyV(dest, source, count));                              \
+    }                                                                       \
+    if ((((WORD)d ^ (WORD)s) & 1) == 0){                                    \
+        if ((WORD)d & 1){                   /*odd start, one byte first*/   \
+            *d++ = *s++;                                                    \
+            count--;                                                        \
+        }                                                                   \
+        if (count & 1){                     /*and an odd one at the end*/   \
+            d[count - 1] = s[count - 1];                                    \
+        }                                                                   \
+        count >>= 1;                                                        \
+        DMA##n##CTL &= ~DMASBDB;            /*word to word*/                \
+    } else {                                                                \
+        DMA##n##CTL |= DMASBDB;             /*byte to byte*/                \
+    }                                                                       \
+                                                                            \
+    DMA##n##DA = __DMA_ACCESS_REG__ d;      /*set destination for DMAx*/    \
+    DMA##n##SA = __DMA_ACCESS_REG__ s;      /*set source for DMAx*/         \
+    DMA##n##SZ = count;                     /*how many transfers*/          \
+                                                                            \
+    DMA##n##CTL |= DMAEN;                   /*enable DMAx*/                 \
+    DMA##n##CTL |= DMAREQ;                  /*trigger DMAx*/                \
+                                                                            \
+    while (!(DMA##n##CTL & DMAIFG)) ;       /*wait for DMA transfer finished*/ \
+                                                                            \
+    DMA##n##CTL &= ~(DMAEN + DMAIFG);       /*disable DMAx, ready for next*/ \
+    return (dest);                                                          \
 }
 
-//this functions starts DMA transfer to/from USB memory into/from RAM
-//Using DMA2
-//Support only for data in <64k memory area.
-VOID * memcpyDMA2 (VOID * dest, const VOID * source, size_t count)
-{
-    if (count == 0){                                        //do nothing if zero bytes to transfer
-        return (dest);
-    }
-
-    DMA2DA = __DMA_ACCESS_REG__ dest;                       //set destination for DMAx
-    DMA2SA = __DMA_ACCESS_REG__ source;                     //set source for DMAx
-    DMA2SZ = count;                                         //how many bytes to transfer
-
-    DMA2CTL |= DMAEN;                                       //enable DMAx
-    DMA2CTL |= DMAREQ;                                      //trigger DMAx
-
-    //wait for DMA transfer finished
-    while (!(DMA2CTL & DMAIFG)) ;
-
-    DMA2CTL &= ~DMAEN;                                      //disable DMAx
-    return (dest);
-}
+MEMCPY_DMA(0)
+MEMCPY_DMA(1)
+MEMCPY_DMA(2)
 
 /*----------------------------------------------------------------------------+
  | End of source file                                                          |
@@ -0,0 +1,111 @@
+/* Software Hamming ECC for NAND, see nand_ecc.h for the format */
+
+#include "nand_ecc.h"
+
+/* Parity of each byte value. Column parities are linear in the data, so
+   they can be taken from the XOR of all bytes at the end; per byte we
+   only need to know whether it has odd parity for the line parities.
+   That keeps the inner loop at a lookup and two XORs. */
+static const uint8_t parity[256] = {
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+};
+
+void nand_ecc_init(struct nand_ecc_ctx *ctx) {
+	ctx->idx = 0;
+	ctx->colx = 0;
+	ctx->lpo = 0;
+	ctx->n = 0;
+}
+
+void nand_ecc_update(struct nand_ecc_ctx *ctx, const uint8_t *data, int len) {
+	uint8_t idx = ctx->idx, colx = ctx->colx, lpo = ctx->lpo, n = ctx->n;
+
+	while (len--) {
+		uint8_t b = *data++;
+		colx ^= b;
+		if (parity[b]) {
+			lpo ^= idx;
+			n ^= 1;
+		}
+		idx++;
+	}
+	ctx->idx = idx;
+	ctx->colx = colx;
+	ctx->lpo = lpo;
+	ctx->n = n;
+}
+
+/* Move bits 0..3 to bits 0, 2, 4, 6 */
+static uint8_t spread(uint8_t x) {
+	x = (x | (x<<2)) & 0x33;
+	return (x | (x<<1)) & 0x55;
+}
+
+void nand_ecc_final(const struct nand_ecc_ctx *ctx, uint8_t *code) {
+	/* Line parity for "index bit clear" is the XOR of the complemented
+	   indices, which differs from lpo only if n is odd. */
+	uint8_t lpo = ctx->lpo, lpe = ctx->n ? ~lpo : lpo;
+	uint8_t c = ctx->colx, cp;
+
+	code[0] = ~((spread(lpo&0x0f)<<1) | spread(lpe&0x0f));
+	code[1] = ~((spread(lpo>>4)<<1) | spread(lpe>>4));
+
+	cp  = parity[c&0xf0]<<7;
+	cp |= parity[c&0x0f]<<6;
+	cp |= parity[c&0xcc]<<5;
+	cp |= parity[c&0x33]<<4;
+	cp |= parity[c&0xaa]<<3;
+	cp |= parity[c&0x55]<<2;
+	code[2] = ~cp | 0x03;
+}
+
+void nand_ecc_calculate(const uint8_t *data, uint8_t *code) {
+	struct nand_ecc_ctx ctx;
+	nand_ecc_init(&ctx);
+	nand_ecc_update(&ctx, data, NAND_ECC_STEP);
+	nand_ecc_final(&ctx, code);
+}
+
+/* Collect bits 1, 3, 5, 7 into a nibble */
+static uint8_t oddbits(uint8_t x) {
+	return ((x>>1)&1) | ((x>>2)&2) | ((x>>3)&4) | ((x>>4)&8);
+}
+
+int nand_ecc_correct(uint8_t *data, const uint8_t *readecc, const uint8_t *calcecc) {
+	uint8_t b0 = readecc[0]^calcecc[0];
+	uint8_t b1 = readecc[1]^calcecc[1];
+	uint8_t b2 = readecc[2]^calcecc[2];
+	int bits;
+
+	if ((b0|b1|b2) == 0)
+		return 0;
+
+	/* A single data bit error flips exactly one of each parity pair */
+	if (((b0^(b0>>1))&0x55) == 0x55 &&
+	    ((b1^(b1>>1))&0x55) == 0x55 &&
+	    ((b2^(b2>>1))&0x54) == 0x54) {
+		data[(oddbits(b1)<<4) | oddbits(b0)] ^= 1<<oddbits(b2>>2);
+		return 1;
+	}
+
+	/* A single flipped bit in the stored ECC leaves the data intact */
+	for (bits=0; b0; b0&=b0-1) bits++;
+	for (; b1; b1&=b1-1) bits++;
+	for (; b2; b2&=b2-1) bits++;
+	return bits==1 ? 1 : -1;
+}
@@ -0,0 +1,34 @@
+/* Software Hamming ECC for NAND chips without on-die ECC.
+
+   Each 256 byte step of a page gets 3 bytes of ECC, in the same layout
+   as the Linux MTD software ECC (nand_ecc.c, without SMC byte order), so
+   images for such chips can be prepared on a host with stock tools.
+   One flipped bit per step is corrected, two are detected.
+
+   This file has no hardware dependencies, so it builds on a host too. */
+
+#include <stdint.h>
+
+#define NAND_ECC_STEP 256
+#define NAND_ECC_BYTES 3
+
+/* Running state, so ECC can be computed as data streams past in pieces.
+   A step is complete once exactly NAND_ECC_STEP bytes were fed. */
+struct nand_ecc_ctx {
+	uint8_t idx;	/* Byte index within the step, wraps at 256 */
+	uint8_t colx;	/* XOR of all bytes, gives column parity */
+	uint8_t lpo;	/* XOR of indices of odd parity bytes */
+	uint8_t n;	/* Number of odd parity bytes, only bit 0 matters */
+};
+
+void nand_ecc_init(struct nand_ecc_ctx *ctx);
+void nand_ecc_update(struct nand_ecc_ctx *ctx, const uint8_t *data, int len);
+void nand_ecc_final(const struct nand_ecc_ctx *ctx, uint8_t *code);
+
+/* Convenience for a whole step held in memory */
+void nand_ecc_calculate(const uint8_t *data, uint8_t *code);
+
+/* Compare ECC read from spare area with calculated ECC and fix data.
+   Returns 0 if clean, 1 if a single bit error was corrected (in data or
+   in the ECC itself), -1 if the step is uncorrectable. */
+int nand_ecc_correct(uint8_t *data, const uint8_t *readecc, const uint8_t *calcecc);
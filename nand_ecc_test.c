@@ -0,0 +1,221 @@
+/* Host test for nand_ecc.c, run with "make test".
+
+   The optimised ECC is checked against fixed vectors and against a bit
+   by bit model of the Linux MTD Hamming code: every data bit (byte i,
+   bit j) is counted in line parity rp[2k+bit k of i] for k=0..7 and in
+   column parity cp[2m+bit m of j] for m=0..2, and the code bytes hold
+   the inverted parities, rp0..rp7, rp8..rp15, then cp0..cp5 from bit 2. */
+
+#include <stdio.h>
+#include <string.h>
+#include "nand_ecc.h"
+
+static int failed;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failed++; \
+	} \
+} while (0)
+
+static void model_ecc(const uint8_t *data, uint8_t *code) {
+	uint8_t rp[16] = {0}, cp[6] = {0};
+	int i, j, k;
+
+	for (i=0; i<NAND_ECC_STEP; i++)
+		for (j=0; j<8; j++) {
+			if (!(data[i]>>j & 1))
+				continue;
+			for (k=0; k<8; k++)
+				rp[2*k + (i>>k & 1)] ^= 1;
+			for (k=0; k<3; k++)
+				cp[2*k + (j>>k & 1)] ^= 1;
+		}
+	code[0] = code[1] = 0;
+	for (k=0; k<8; k++) {
+		code[0] |= rp[k]<<k;
+		code[1] |= rp[8+k]<<k;
+	}
+	code[2] = 0;
+	for (k=0; k<6; k++)
+		code[2] |= cp[k]<<(k+2);
+	code[0] = ~code[0];
+	code[1] = ~code[1];
+	code[2] = ~code[2];
+}
+
+/* Small xorshift, so runs are repeatable */
+static uint32_t seed = 0x2545f491;
+
+static uint8_t rnd(void) {
+	seed ^= seed<<13;
+	seed ^= seed>>17;
+	seed ^= seed<<5;
+	return seed;
+}
+
+static void fill(uint8_t *data, int pattern) {
+	int i;
+
+	for (i=0; i<NAND_ECC_STEP; i++)
+		switch (pattern) {
+		case 0: data[i] = 0xff; break;
+		case 1: data[i] = 0x00; break;
+		case 2: data[i] = i; break;
+		case 3: data[i] = i&1 ? 0x55 : 0xaa; break;
+		default: data[i] = rnd(); break;
+		}
+}
+
+#define PATTERNS 20
+
+static void test_vectors(void) {
+	static const struct {
+		int byte;
+		uint8_t val;
+		uint8_t code[NAND_ECC_BYTES];
+	} one[] = {
+		{ -1, 0, { 0xff, 0xff, 0xff } },	/* Erased */
+		{ 0, 0x01, { 0xaa, 0xaa, 0xab } },
+		{ 0, 0x80, { 0xaa, 0xaa, 0x57 } },
+		{ 255, 0x01, { 0x55, 0x55, 0xab } },
+		{ 255, 0x80, { 0x55, 0x55, 0x57 } },
+		{ 0x5a, 0x10, { 0x66, 0x99, 0x6b } },
+	};
+	uint8_t data[NAND_ECC_STEP], code[NAND_ECC_BYTES], ref[NAND_ECC_BYTES];
+	struct nand_ecc_ctx ctx;
+	int i, p;
+
+	for (i=0; i<(int)(sizeof one/sizeof one[0]); i++) {
+		memset(data, 0, sizeof data);
+		if (one[i].byte >= 0)
+			data[one[i].byte] = one[i].val;
+		nand_ecc_calculate(data, code);
+		CHECK(!memcmp(code, one[i].code, sizeof code),
+		      "vector %d: %02x %02x %02x", i, code[0], code[1], code[2]);
+		model_ecc(data, ref);
+		CHECK(!memcmp(ref, one[i].code, sizeof ref),
+		      "model vector %d: %02x %02x %02x", i, ref[0], ref[1], ref[2]);
+	}
+
+	for (p=0; p<PATTERNS; p++) {
+		fill(data, p);
+		nand_ecc_calculate(data, code);
+		model_ecc(data, ref);
+		CHECK(!memcmp(code, ref, sizeof code), "pattern %d: %02x %02x %02x, model %02x %02x %02x",
+		      p, code[0], code[1], code[2], ref[0], ref[1], ref[2]);
+
+		/* Fed in uneven pieces, as reads stream in */
+		nand_ecc_init(&ctx);
+		for (i=0; i<NAND_ECC_STEP; i+=37)
+			nand_ecc_update(&ctx, data+i, NAND_ECC_STEP-i < 37 ? NAND_ECC_STEP-i : 37);
+		nand_ecc_final(&ctx, code);
+		CHECK(!memcmp(code, ref, sizeof code), "pattern %d in pieces", p);
+	}
+}
+
+static void test_clean(void) {
+	uint8_t data[NAND_ECC_STEP], copy[NAND_ECC_STEP], code[NAND_ECC_BYTES];
+	int p;
+
+	for (p=0; p<PATTERNS; p++) {
+		fill(data, p);
+		memcpy(copy, data, sizeof copy);
+		nand_ecc_calculate(data, code);
+		CHECK(nand_ecc_correct(data, code, code) == 0, "pattern %d not clean", p);
+		CHECK(!memcmp(data, copy, sizeof data), "pattern %d changed", p);
+	}
+}
+
+static void test_data_bit(void) {
+	uint8_t data[NAND_ECC_STEP], good[NAND_ECC_STEP];
+	uint8_t stored[NAND_ECC_BYTES], calc[NAND_ECC_BYTES];
+	int p, bit, r;
+
+	for (p=0; p<PATTERNS; p++) {
+		fill(good, p);
+		nand_ecc_calculate(good, stored);
+		for (bit=0; bit<NAND_ECC_STEP*8; bit++) {
+			memcpy(data, good, sizeof data);
+			data[bit/8] ^= 1<<(bit%8);
+			nand_ecc_calculate(data, calc);
+			r = nand_ecc_correct(data, stored, calc);
+			CHECK(r == 1, "pattern %d data bit %d: returned %d", p, bit, r);
+			CHECK(!memcmp(data, good, sizeof data), "pattern %d data bit %d not fixed", p, bit);
+		}
+	}
+}
+
+static void test_ecc_bit(void) {
+	uint8_t data[NAND_ECC_STEP], good[NAND_ECC_STEP];
+	uint8_t stored[NAND_ECC_BYTES], calc[NAND_ECC_BYTES];
+	int p, bit, r;
+
+	for (p=0; p<PATTERNS; p++) {
+		fill(good, p);
+		nand_ecc_calculate(good, calc);
+		/* Bits 0 and 1 of the third byte are unused, but still count */
+		for (bit=0; bit<NAND_ECC_BYTES*8; bit++) {
+			memcpy(data, good, sizeof data);
+			memcpy(stored, calc, sizeof stored);
+			stored[bit/8] ^= 1<<(bit%8);
+			r = nand_ecc_correct(data, stored, calc);
+			CHECK(r == 1, "pattern %d ECC bit %d: returned %d", p, bit, r);
+			CHECK(!memcmp(data, good, sizeof data), "pattern %d ECC bit %d touched data", p, bit);
+		}
+	}
+}
+
+static void test_double_bit(void) {
+	uint8_t data[NAND_ECC_STEP], good[NAND_ECC_STEP];
+	uint8_t stored[NAND_ECC_BYTES], calc[NAND_ECC_BYTES];
+	int p, a, b, r, n = 0;
+
+	for (p=0; p<4; p++) {
+		fill(good, p);
+		nand_ecc_calculate(good, stored);
+		for (a=0; a<NAND_ECC_STEP*8; a+=7)
+			for (b=a+1; b<NAND_ECC_STEP*8; b+=13) {
+				memcpy(data, good, sizeof data);
+				data[a/8] ^= 1<<(a%8);
+				data[b/8] ^= 1<<(b%8);
+				nand_ecc_calculate(data, calc);
+				r = nand_ecc_correct(data, stored, calc);
+				CHECK(r == -1, "pattern %d data bits %d, %d: returned %d", p, a, b, r);
+				n++;
+			}
+		/* One bit in the data and one in the stored ECC. Like Linux,
+		   correction ignores the two unused bits, so skip those. */
+		for (a=0; a<NAND_ECC_STEP*8; a+=5)
+			for (b=0; b<NAND_ECC_BYTES*8; b++) {
+				if (b == 16 || b == 17)
+					continue;
+				memcpy(data, good, sizeof data);
+				data[a/8] ^= 1<<(a%8);
+				nand_ecc_calculate(data, calc);
+				stored[b/8] ^= 1<<(b%8);
+				r = nand_ecc_correct(data, stored, calc);
+				stored[b/8] ^= 1<<(b%8);
+				CHECK(r == -1, "pattern %d data bit %d, ECC bit %d: returned %d", p, a, b, r);
+				n++;
+			}
+	}
+	CHECK(n > 0, "no double bit cases");
+}
+
+int main(void) {
+	test_vectors();
+	test_clean();
+	test_data_bit();
+	test_ecc_bit();
+	test_double_bit();
+	if (failed) {
+		printf("nand_ecc: %d checks failed\n", failed);
+		return 1;
+	}
+	printf("nand_ecc: all checks passed\n");
+	return 0;
+}
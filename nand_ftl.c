@@ -0,0 +1,416 @@
+/* Log-structured flash translation layer.
+
+   The region is cut into 512 byte slots, each programmed as a partial
+   page. Every write goes to the next free slot of the head block, with
+   the logical sector number in the slot's spare tag (nand_tag_column),
+   and the old copy simply becomes stale. The map from sectors to slots
+   lives in RAM.
+
+   Slot 0 of every block holds a checkpoint: the map and erase counts as
+   they were when the block became head. Mounting reads slot 0 of each
+   block, loads the newest checkpoint, and replays the tags of that one
+   block, since all later writes went there. That keeps mounting to a
+   few dozen page reads however long the device has been in use.
+
+   Blocks are erased when they become head, choosing the least worn free
+   one. When free blocks run low, ftl_idle moves the valid slots of the
+   block with fewest of them to the head, one slot per call. If erase
+   counts drift too far apart, the least worn block is moved likewise so
+   its cold data stops pinning it. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <nand_ordb3.h>
+#include <nand_ftl.h>
+
+#define FTL_MAGIC	0x314c5446	/* "FTL1" */
+#define TAG_CKPT	0xfffe
+#define NOSLOT		0xffff
+#define BADBLOCK	0xffff	/* In erase counts */
+#define GC_FREE		4	/* Collect garbage below this many free blocks */
+#define WRITE_FREE	2	/* Leave one block for collection */
+#define WEAR_GAP	256	/* Erase count spread for static levelling */
+#define LOGBYTES	((uint16_t)FTL_LOG_SECTORS*FTL_SECTOR)
+#define MIN_BLOCKS	(FTL_BLOCKS/2)	/* Usable ones needed to format */
+
+/* Written as-is as slot 0 of each block, so it must be one sector */
+static struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint16_t logpos;	/* Byte offset of the end of the FPGA log */
+	uint16_t erases[FTL_BLOCKS];
+	uint16_t map[FTL_SECTORS];
+} ck;
+
+static struct nand_geometry g;
+static uint8_t buf[FTL_SECTOR];
+static uint16_t valid[FTL_BLOCKS];
+static uint32_t firstblock;
+static uint16_t ppb, spp, spb;	/* Pages per block, slots per page/block */
+static uint8_t mounted, head;
+static uint16_t headslot;
+static int8_t victim=-1;
+
+static uint8_t logbuf[16], logfill;
+
+static struct {
+	uint8_t busy;		/* buf holds request data */
+	uint8_t cmd, addridx, failed;
+	uint16_t sector, pos;
+} hostreq;
+
+static uint32_t slot_row(uint16_t slot) {
+	return (firstblock+slot/spb)*ppb+slot%spb/spp;
+}
+
+static int read_slot(uint16_t slot, void *data) {
+	return nand_page_read(slot_row(slot), slot%spp*FTL_SECTOR, data, FTL_SECTOR);
+}
+
+static int program_slot(uint16_t slot, const void *data, uint16_t tag) {
+	uint16_t t[2];
+
+	t[0]=tag;
+	t[1]=~tag;
+	nand_page_program_start(slot_row(slot));
+	nand_page_program_data(slot%spp*FTL_SECTOR, data, FTL_SECTOR);
+	nand_page_program_data(nand_tag_column(slot%spp), t, sizeof t);
+	return nand_page_program_finish();
+}
+
+static int free_blocks(void) {
+	int b, n=0;
+	for (b=0; b<FTL_BLOCKS; b++)
+		if (b!=head && ck.erases[b]!=BADBLOCK && !valid[b])
+			n++;
+	return n;
+}
+
+/* Erase the least worn free block and start it with a checkpoint */
+static int open_block(int minfree) {
+	int b, pick;
+
+	for (;;) {
+		if (free_blocks()<minfree)
+			return -1;
+		pick=-1;
+		for (b=0; b<FTL_BLOCKS; b++)
+			if (b!=head && ck.erases[b]!=BADBLOCK && !valid[b] &&
+			    (pick<0 || ck.erases[b]<ck.erases[pick]))
+				pick=b;
+		if (nand_block_erase(firstblock+pick)==0)
+			break;
+		ck.erases[pick]=BADBLOCK;
+	}
+	ck.erases[pick]++;
+	ck.seq++;
+	head=pick;
+	headslot=1;
+	return program_slot(pick*spb, &ck, TAG_CKPT);
+}
+
+static int append(uint16_t sector, const void *data, int minfree) {
+	uint16_t slot, old;
+	int tries;
+
+	for (tries=0; tries<2; tries++) {
+		if (headslot>=spb && open_block(minfree)<0)
+			return -1;
+		slot=head*spb+headslot++;
+		if (program_slot(slot, data, sector)<0) {
+			headslot=spb;  // Give up on this block, it gets collected
+			continue;
+		}
+		old=ck.map[sector];
+		if (old!=NOSLOT)
+			valid[old/spb]--;
+		ck.map[sector]=slot;
+		valid[head]++;
+		return 0;
+	}
+	return -1;
+}
+
+int ftl_read(uint16_t sector, void *data) {
+	int ret;
+
+	if (!mounted || sector>=FTL_SECTORS)
+		return -1;
+	if (ck.map[sector]==NOSLOT) {
+		memset(data, 0xff, FTL_SECTOR);
+		return 0;
+	}
+	ret=read_slot(ck.map[sector], data);
+	nand_close();
+	return ret;
+}
+
+int ftl_write(uint16_t sector, const void *data) {
+	int ret;
+
+	if (!mounted || sector>=FTL_SECTORS)
+		return -1;
+	ret=append(sector, data, WRITE_FREE);
+	nand_close();
+	return ret;
+}
+
+/* Replay the head block after its checkpoint */
+static void replay(void) {
+	uint16_t slot, t[2];
+
+	for (headslot=1; headslot<spb; headslot++) {
+		slot=head*spb+headslot;
+		if (headslot==1 || slot%spp==0)
+			nand_page_read(slot_row(slot), g.pagebytes, buf, g.sparebytes);
+		memcpy(t, buf+nand_tag_column(slot%spp)-g.pagebytes, sizeof t);
+		if (t[0]==0xffff && t[1]==0xffff)
+			break;  // End of the log
+		if (t[0]<FTL_SECTORS && t[1]==(uint16_t)~t[0])
+			ck.map[t[0]]=slot;
+	}
+}
+
+/* The checkpoint may be behind the end of the FPGA log; follow it
+   through sectors written since */
+static void log_mount(void) {
+	uint16_t n, off, sector;
+
+	for (n=FTL_LOG_SECTORS; n--; ) {
+		sector=FTL_LOG_FIRST+ck.logpos/FTL_SECTOR;
+		off=ck.logpos%FTL_SECTOR;
+		if (ftl_read(sector, buf)<0)
+			return;
+		while (off<FTL_SECTOR && buf[off]!=0xff) {
+			off++;
+			ck.logpos++;
+		}
+		if (off<FTL_SECTOR)
+			return;
+		ck.logpos%=LOGBYTES;
+		sector=FTL_LOG_FIRST+ck.logpos/FTL_SECTOR;
+		if (ck.map[sector]==NOSLOT || ck.map[sector]/spb!=head)
+			return;
+	}
+}
+
+/* Formatting must not take blocks that hold something else: the boot
+   image, per page 0, or anything written raw with the v1 protocol, seen
+   as a first sector that is not blank */
+static int foreign_block(int b, const struct nand_image_hdr *img) {
+	int i;
+
+	for (i=0; i<NAND_IMAGE_BLOCKS; i++)
+		if (img->blocks[i]==(long)(firstblock+b))
+			return 1;
+	read_slot(b*spb, buf);  // Blank reads fine even if its ECC did not
+	for (i=0; i<FTL_SECTOR; i++)
+		if (buf[i]!=0xff)
+			return 1;
+	return 0;
+}
+
+int ftl_mount(void) {
+	struct nand_image_hdr img;
+	uint32_t hdr[2], bestseq=0;
+	uint16_t t[2], s;
+	int b, best=-1;
+
+	mounted=0;
+	nand_get_geometry(&g);
+	if (g.blocks<=2*FTL_BLOCKS || g.pagebytes<FTL_SECTOR)
+		return -1;
+	ppb=g.pagesperblock;
+	spp=g.pagebytes/FTL_SECTOR;
+	spb=ppb*spp;
+	firstblock=g.blocks-FTL_BLOCKS;
+
+	for (b=0; b<FTL_BLOCKS; b++) {
+		if (read_slot(b*spb, buf)<0 ||
+		    nand_page_read(slot_row(b*spb), nand_tag_column(0), t, sizeof t)<0)
+			continue;
+		memcpy(hdr, buf, sizeof hdr);
+		if (t[0]!=TAG_CKPT || t[1]!=(uint16_t)~TAG_CKPT || hdr[0]!=FTL_MAGIC)
+			continue;
+		if (best<0 || hdr[1]>bestseq) {
+			best=b;
+			bestseq=hdr[1];
+		}
+	}
+
+	memset(valid, 0, sizeof valid);
+	if (best<0) {
+		/* Nothing there yet */
+		memset(&ck, 0xff, sizeof ck);
+		ck.magic=FTL_MAGIC;
+		ck.seq=0;
+		ck.logpos=0;
+		if (nand_image_hdr_read(&img, sizeof img)<0) {
+			nand_close();
+			return -1;  // Cannot tell where the image is
+		}
+		for (s=0, b=0; b<FTL_BLOCKS; b++) {
+			// Left out for good, like bad blocks
+			if (nand_block_bad(firstblock+b) || foreign_block(b, &img))
+				ck.erases[b]=BADBLOCK;
+			else {
+				ck.erases[b]=0;
+				s++;
+			}
+		}
+		if (s<MIN_BLOCKS) {
+			nand_close();
+			return -1;  // Not ours to take
+		}
+		head=FTL_BLOCKS;
+		mounted=1;
+		b=open_block(1);
+		nand_close();
+		mounted=b==0;
+		return b;
+	}
+	read_slot(best*spb, &ck);
+	head=best;
+	replay();
+	for (s=0; s<FTL_SECTORS; s++)
+		if (ck.map[s]!=NOSLOT)
+			valid[ck.map[s]/spb]++;
+	nand_close();
+	mounted=1;
+	log_mount();
+	return 0;
+}
+
+/* Append queued log bytes to the log sector */
+static int log_flush(void) {
+	uint16_t sector=FTL_LOG_FIRST+ck.logpos/FTL_SECTOR;
+	uint16_t off=ck.logpos%FTL_SECTOR;
+	uint8_t n=logfill;
+
+	if (off && (ck.map[sector]==NOSLOT || read_slot(ck.map[sector], buf)<0)) {
+		ck.logpos=(ck.logpos+FTL_SECTOR-off)%LOGBYTES;  // Lost, start afresh
+		return -1;
+	}
+	if (!off)
+		memset(buf, 0xff, FTL_SECTOR);
+	if (n>FTL_SECTOR-off)
+		n=FTL_SECTOR-off;
+	memcpy(buf+off, logbuf, n);
+	if (append(sector, buf, WRITE_FREE)<0)
+		return -1;
+	ck.logpos=(ck.logpos+n)%LOGBYTES;
+	logfill-=n;
+	memmove(logbuf, logbuf+n, logfill);
+	return 0;
+}
+
+void ftl_log_byte(uint8_t b) {
+	if (logfill<sizeof logbuf)
+		logbuf[logfill++]=b;
+}
+
+static int pick_victim(void) {
+	int b, pick=-1, lo=-1, hi=-1;
+
+	for (b=0; b<FTL_BLOCKS; b++) {
+		if (ck.erases[b]==BADBLOCK)
+			continue;
+		if (hi<0 || ck.erases[b]>ck.erases[hi])
+			hi=b;
+		if (b!=head && (lo<0 || ck.erases[b]<ck.erases[lo]))
+			lo=b;
+	}
+	if (lo>=0 && valid[lo] && ck.erases[hi]-ck.erases[lo]>WEAR_GAP)
+		return lo;  // Static levelling
+	if (free_blocks()>=GC_FREE)
+		return -1;
+	for (b=0; b<FTL_BLOCKS; b++)
+		if (b!=head && ck.erases[b]!=BADBLOCK && valid[b] &&
+		    (pick<0 || valid[b]<valid[pick]))
+			pick=b;
+	return pick;
+}
+
+int ftl_idle(void) {
+	uint16_t s;
+	int ret=1;
+
+	if (!mounted || hostreq.busy || nand_state.addr_bytes ||
+	    nand_state.writelen || nand_state.readlen)
+		return 0;  // FLASH interface is using the chip
+	if (logfill && log_flush()==0) {
+		nand_close();
+		return 1;
+	}
+	if (victim<0 && (victim=pick_victim())<0)
+		return 0;
+
+	/* Move one valid slot of the victim */
+	for (s=0; s<FTL_SECTORS; s++)
+		if (ck.map[s]!=NOSLOT && ck.map[s]/spb==victim)
+			break;
+	if (s==FTL_SECTORS) {
+		victim=-1;
+		return 1;
+	}
+	read_slot(ck.map[s], buf);  // Damaged or not, it is all we have
+	if (append(s, buf, 1)<0) {
+		victim=-1;
+		ret=0;
+	}
+	nand_close();
+	return ret;
+}
+
+int ftl_request_start(void) {
+	uint8_t cmd=nand_state.cmd;
+
+	if (!mounted || nand_state.addr_bytes!=2 ||
+	    !((cmd==FTL_CMD_READ && nand_state.readlen==FTL_SECTOR &&
+	       !nand_state.writelen) ||
+	      (cmd==FTL_CMD_WRITE && nand_state.writelen==FTL_SECTOR &&
+	       !nand_state.readlen)))
+		return -1;
+	hostreq.busy=1;
+	hostreq.cmd=cmd;
+	hostreq.addridx=0;
+	hostreq.failed=0;
+	hostreq.sector=0;
+	hostreq.pos=0;
+	return 0;
+}
+
+void ftl_request_data(const char *data, int len) {
+	while (len && nand_state.addr_bytes) {
+		hostreq.sector|=(uint16_t)(uint8_t)*data++<<(8*hostreq.addridx++);
+		len--;
+		if (!--nand_state.addr_bytes && hostreq.cmd==FTL_CMD_READ)
+			hostreq.failed=ftl_read(hostreq.sector, buf)<0;
+	}
+	if (len>nand_state.writelen)
+		len=nand_state.writelen;
+	memcpy(buf+hostreq.pos, data, len);
+	hostreq.pos+=len;
+	nand_state.writelen-=len;
+	if (hostreq.cmd==FTL_CMD_WRITE && !nand_state.addr_bytes &&
+	    !nand_state.writelen) {
+		hostreq.failed=ftl_write(hostreq.sector, buf)<0;
+		hostreq.busy=0;
+	}
+}
+
+int ftl_request_produce(char *data, int len) {
+	if (len>nand_state.readlen)
+		len=nand_state.readlen;
+	memcpy(data, buf+hostreq.pos, len);
+	hostreq.pos+=len;
+	nand_state.readlen-=len;
+	if (!nand_state.readlen)
+		hostreq.busy=0;
+	return len;
+}
+
+int ftl_request_failed(void) {
+	return hostreq.failed;
+}
@@ -0,0 +1,46 @@
+/* Flash translation layer over the last FTL_BLOCKS blocks of the NAND,
+   see nand_ftl.c. Boot images (nand_msc.c) never go there. Sectors are
+   FTL_SECTOR bytes and may be rewritten at will; unwritten ones read
+   as 0xff. */
+
+#define FTL_SECTOR	512
+#define FTL_BLOCKS	16
+#define FTL_SECTORS	235	/* Sized so a checkpoint fills one sector */
+
+/* The FPGA log: command bytes from the FPGA (bCommand) are appended to
+   the last FTL_LOG_SECTORS sectors, used as a ring. Bytes are 7 bits,
+   so the first 0xff marks the end of the log. */
+#define FTL_LOG_SECTORS	64
+#define FTL_LOG_FIRST	(FTL_SECTORS-FTL_LOG_SECTORS)
+
+/* Host access with protocol v2 requests flagged NANDREQ2_FTL: cmd is
+   FTL_CMD_READ or FTL_CMD_WRITE, two address bytes give the sector
+   (little endian), then FTL_SECTOR bytes are written or read. */
+#define FTL_CMD_READ	0x00
+#define FTL_CMD_WRITE	0x80
+
+/* Find the latest checkpoint and replay the log after it; formats the
+   region if there is none. Call once after Do_NAND_Probe.
+
+   Boards whose boot image (or raw v1 data) was written by older tools
+   may have data in the region. Formatting leaves out every block that
+   page 0 lists or whose first sector is not blank, as if it were bad,
+   and refuses (returns -1, FTL unavailable) if fewer than half the
+   blocks are left, or page 0 cannot be read. Nothing is erased then. */
+extern int ftl_mount(void);
+/* Both return -1 on failure. Writes fail when free blocks run short,
+   until ftl_idle has collected garbage. */
+extern int ftl_read(uint16_t sector, void *data);
+extern int ftl_write(uint16_t sector, const void *data);
+/* Garbage collection and wear levelling, a little per call. Call from
+   the main loop; returns nonzero while there is more to do. */
+extern int ftl_idle(void);
+/* Queue a byte for the FPGA log, written out by ftl_idle */
+extern void ftl_log_byte(uint8_t b);
+
+/* Used by nand_usb_service for NANDREQ2_FTL requests, with nand_state
+   holding the request. Start returns -1 if it is malformed. */
+extern int ftl_request_start(void);
+extern void ftl_request_data(const char *data, int len);
+extern int ftl_request_produce(char *data, int len);
+extern int ftl_request_failed(void);
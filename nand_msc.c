@@ -0,0 +1,370 @@
+/* USB mass storage view of the boot image store.
+
+   The host sees a small FAT12 volume holding one file, FPGA.XSV, which
+   is the image the loader plays from NAND (see xsvf_setup). The boot
+   sector, FATs and root directory are made up on the fly from the image
+   header in page 0; only file data lives in NAND.
+
+   Data sectors written by the host go straight to fresh blocks, away
+   from the current image, so an interrupted copy leaves the old one
+   bootable. A data write at the start of a cluster begins the new
+   image and the rest must follow in ascending order, which is what file
+   managers do when copying a single file. Once a root directory entry
+   names the image's first cluster, only a write at the first cluster
+   of another root directory file replaces it; other data writes, such
+   as the metadata hosts keep in directories of their own, are ignored.
+   Once that entry's size has been written, page 0 is rewritten to point
+   at the new blocks, after a copy of it went to the backup header block
+   (NAND_HDR_BACKUP).
+
+   Each 512 byte sector is programmed as a partial page, which relies on
+   the SLC parts fitted allowing several programs per page. Collecting
+   whole pages for cache programming would take half our RAM. */
+
+#include <stdint.h>
+#include <string.h>
+#include <msp430.h>
+
+#include <USB_API/USB_Common/types.h>
+#include <USB_API/USB_MSC_API/UsbMsc.h>
+
+#include <nand_ordb3.h>
+#include <nand_msc.h>
+#include <nand_ftl.h>
+
+#define SECTOR		512
+#define SECPERCLUS	8
+#define CLUSBYTES	((uint32_t)SECPERCLUS*SECTOR)
+#define NFATS		2
+#define FATSECS		6	/* Enough for 2048 12-bit entries */
+#define ROOTENTS	16
+#define ROOTSEC		(1+NFATS*FATSECS)
+#define DATASEC		(ROOTSEC+ROOTENTS*32/SECTOR)
+#define TOTALSECS	16384	/* 8MiB, twice the largest image */
+#define CLUSTERS	((TOTALSECS-DATASEC)/SECPERCLUS)
+#define MAXIMAGE	((uint32_t)CLUSTERS*CLUSBYTES/2)
+
+static const uint8_t bootsector[62] = {
+	0xeb, 0x3c, 0x90,			// Jump
+	'M','S','W','I','N','4','.','1',	// OEM name
+	PUTWORD(SECTOR),			// Bytes per sector
+	SECPERCLUS,
+	PUTWORD(1),				// Reserved sectors
+	NFATS,
+	PUTWORD(ROOTENTS),
+	PUTWORD(TOTALSECS),
+	0xf8,					// Media: fixed disk
+	PUTWORD(FATSECS),
+	PUTWORD(32), PUTWORD(2),		// Sectors per track, heads
+	0, 0, 0, 0,				// Hidden sectors
+	0, 0, 0, 0,				// Large sector count
+	0x80, 0, 0x29,				// Drive, reserved, signature
+	0x3a, 0xdb, 0x02, 0x0b,			// Serial number
+	'O','R','D','B','3','A',' ','B','O','O','T',
+	'F','A','T','1','2',' ',' ',' ',
+};
+
+static const uint8_t rootdir[2][32] = {
+	{ 'O','R','D','B','3','A',' ','B','O','O','T', 0x08 },
+	{ 'F','P','G','A',' ',' ',' ',' ','X','S','V', 0x20,
+	  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// Times, 0:00
+	  PUTWORD((34<<9)|(1<<5)|1),		// 2014-01-01
+	  PUTWORD(2) },				// First cluster, size follows
+};
+
+static uint8_t secbuf[SECTOR];	/* Registered with the MSC stack */
+static struct nand_geometry g;
+static struct nand_image_hdr hdr;	/* Copy of page 0 */
+
+/* Image being written by the host */
+static struct {
+	uint8_t active;
+	uint8_t named;		/* A root directory file starts here */
+	uint8_t nblocks;
+	uint32_t startsec;	/* Volume sector of image byte 0 */
+	uint32_t next;		/* Image offset we expect next */
+	uint32_t lastblock;	/* Most recently allocated block */
+	long blocks[NAND_IMAGE_BLOCKS];
+} wr;
+
+/* First clusters of the files in the last root directory written */
+static uint16_t rootclus[ROOTENTS];
+
+static int valid_block(long b) {
+	return b>0 && b<g.blocks;
+}
+
+static int in_list(const long *list, int n, long b) {
+	while (n--)
+		if (*list++==b)
+			return 1;
+	return 0;
+}
+
+static uint32_t blockbytes(void) {
+	return (uint32_t)g.pagebytes*g.pagesperblock;
+}
+
+static uint32_t image_size(void) {
+	uint32_t size;
+	int n;
+
+	if (hdr.size>=0)
+		size=hdr.size;
+	else {
+		/* Written by other tools; show all of its blocks */
+		for (n=0; n<NAND_IMAGE_BLOCKS && valid_block(hdr.blocks[n]); n++)
+			;
+		size=n*blockbytes();
+	}
+	return size>MAXIMAGE ? MAXIMAGE : size;
+}
+
+static uint16_t fat_entry(uint16_t n, uint16_t clusters) {
+	if (n<2)
+		return n ? 0xfff : 0xff8;
+	n-=2;
+	if (n>=clusters)
+		return 0;  // Free
+	return n+1==clusters ? 0xfff : n+3;
+}
+
+static void make_fat(uint8_t *p, uint16_t fatsec) {
+	uint16_t clusters=(image_size()+CLUSBYTES-1)/CLUSBYTES;
+	uint16_t i=fatsec*SECTOR, end=i+SECTOR;
+
+	/* Two 12-bit entries per three bytes */
+	for (; i<end; i++) {
+		uint16_t e=fat_entry(i/3*2, clusters);
+		uint16_t o=fat_entry(i/3*2+1, clusters);
+		switch (i%3) {
+		case 0: *p++=e; break;
+		case 1: *p++=(e>>8)|(o<<4); break;
+		case 2: *p++=o>>4; break;
+		}
+	}
+}
+
+/* Read from an image through a block list */
+static int read_image(const long *list, uint32_t off, uint8_t *p) {
+	uint32_t page=off/g.pagebytes;
+	uint16_t blk=page/g.pagesperblock;
+
+	if (blk>=NAND_IMAGE_BLOCKS || !valid_block(list[blk])) {
+		memset(p, 0xff, SECTOR);
+		return 0;
+	}
+	return nand_page_read(list[blk]*g.pagesperblock+page%g.pagesperblock,
+			      off%g.pagebytes, p, SECTOR);
+}
+
+static int read_sector(uint32_t sec, uint8_t *p) {
+	uint32_t size=image_size();
+
+	memset(p, 0, SECTOR);
+	if (sec==0) {
+		memcpy(p, bootsector, sizeof bootsector);
+		p[510]=0x55;
+		p[511]=0xaa;
+	} else if (sec<ROOTSEC) {
+		make_fat(p, (sec-1)%FATSECS);
+	} else if (sec==ROOTSEC) {
+		memcpy(p, rootdir[0], 32);
+		if (size) {
+			memcpy(p+32, rootdir[1], 28);
+			memcpy(p+32+28, &size, 4);  // Little endian, like FAT
+		}
+	} else if (wr.active && sec>=wr.startsec &&
+		   (sec-wr.startsec)*SECTOR<wr.next) {
+		/* Host reads back what it is writing */
+		return read_image(wr.blocks, (sec-wr.startsec)*SECTOR, p);
+	} else if ((sec-DATASEC)*SECTOR<size) {
+		return read_image(hdr.blocks, (sec-DATASEC)*SECTOR, p);
+	}
+	return 0;
+}
+
+/* Take a fresh block for the new image, skipping the current one, the
+   backup header and the FTL region at the end of the chip */
+static int alloc_block(void) {
+	uint32_t b=wr.lastblock, n, end=g.blocks-FTL_BLOCKS;
+
+	if (wr.nblocks>=NAND_IMAGE_BLOCKS)
+		return -1;
+	for (n=end; n--; ) {
+		if (++b>=end)
+			b=1;  // Block 0 holds the header
+		if (b==NAND_HDR_BACKUP ||
+		    in_list(hdr.blocks, NAND_IMAGE_BLOCKS, b) ||
+		    in_list(wr.blocks, wr.nblocks, b) ||
+		    nand_block_bad(b) || nand_block_erase(b)<0)
+			continue;
+		wr.blocks[wr.nblocks++]=b;
+		wr.lastblock=b;
+		return 0;
+	}
+	return -1;
+}
+
+static uint16_t sec_cluster(uint32_t sec) {
+	return (sec-DATASEC)/SECPERCLUS+2;
+}
+
+static int root_file(uint16_t clus) {
+	int i;
+
+	for (i=0; i<ROOTENTS; i++)
+		if (rootclus[i]==clus)
+			return 1;
+	return 0;
+}
+
+static int write_data(uint32_t sec, const uint8_t *p) {
+	uint32_t off, page;
+	uint16_t blk;
+	int start=0, next=0;
+
+	if (wr.active && sec>=wr.startsec) {
+		off=(sec-wr.startsec)*SECTOR;
+		next=off>=wr.next && off-wr.next<CLUSBYTES;
+	}
+	if ((sec-DATASEC)%SECPERCLUS==0) {
+		if (root_file(sec_cluster(sec)))
+			start=2;  // First cluster of a file
+		else if (!(wr.active && wr.named) && !next)
+			start=1;  // Perhaps a file not in the directory yet
+	}
+	if (start) {
+		/* Start of a new image; an unfinished one is dropped */
+		wr.active=1;
+		wr.named=start==2;
+		wr.startsec=sec;
+		wr.next=0;
+		wr.nblocks=0;
+		memset(wr.blocks, 0xff, sizeof wr.blocks);
+	} else if (!next)
+		return 0;  // Not the image being written
+	off=(sec-wr.startsec)*SECTOR;
+	if (off>=MAXIMAGE)
+		return -1;
+	page=off/g.pagebytes;
+	blk=page/g.pagesperblock;
+	while (wr.nblocks<=blk)
+		if (alloc_block()<0)
+			return -1;
+	nand_page_program_start(wr.blocks[blk]*g.pagesperblock+
+				page%g.pagesperblock);
+	nand_page_program_data(off%g.pagebytes, p, SECTOR);
+	if (nand_page_program_finish()<0)
+		return -1;
+	wr.next=off+SECTOR;
+	return 0;
+}
+
+static int write_hdr(long block) {
+	if (nand_block_erase(block)<0)
+		return -1;
+	nand_page_program_start(block*g.pagesperblock);
+	nand_page_program_data(0, secbuf, SECTOR);
+	return nand_page_program_finish();
+}
+
+/* Point page 0 at the new image. The backup goes first, so whichever
+   erase or program a power loss cuts short, one header stays whole.
+   Not if that block is bad, or the old image, put there by other
+   tools, uses it. */
+static int commit_image(uint32_t size) {
+	int backup=!in_list(hdr.blocks, NAND_IMAGE_BLOCKS, NAND_HDR_BACKUP) &&
+		!nand_block_bad(NAND_HDR_BACKUP);
+
+	memcpy(hdr.blocks, wr.blocks, sizeof hdr.blocks);
+	hdr.size=size;
+	wr.active=0;
+
+	memset(secbuf, 0xff, sizeof secbuf);
+	memcpy(secbuf, &hdr, sizeof hdr);
+	if (backup && write_hdr(NAND_HDR_BACKUP)<0)
+		return -1;  // Page 0 still has the old image
+	return write_hdr(0);
+}
+
+/* Note where files start, and look for the directory entry of the
+   image being written */
+static int write_rootdir(const uint8_t *p) {
+	uint16_t clus=sec_cluster(wr.startsec);
+	uint32_t size=0;
+	int i;
+
+	for (i=0; i<ROOTENTS; i++, p+=32) {
+		rootclus[i]=0;
+		if (p[0]==0x00 || p[0]==0xe5 || (p[11]&0x18))
+			continue;  // Free, deleted, label, long name or directory
+		rootclus[i]=p[26]+(p[27]<<8);
+		if (wr.active && rootclus[i]==clus) {
+			wr.named=1;
+			memcpy(&size, p+28, 4);
+		}
+	}
+	if (size && size<=wr.next)
+		return commit_image(size);
+	return 0;  // Not all there yet
+}
+
+static int write_sector(uint32_t sec, const uint8_t *p) {
+	if (sec==ROOTSEC)
+		return write_rootdir(p);
+	if (sec<DATASEC)
+		return 0;  // Boot sector and FATs are made up, ignore
+	return write_data(sec, p);
+}
+
+void nand_msc_init(void) {
+	struct USBMSC_mediaInfoStr info;
+	int i;
+
+	nand_get_geometry(&g);
+	memset(&hdr, 0xff, sizeof hdr);
+	if (g.blocks) {
+		if (nand_image_hdr_read(secbuf, 256)==0)
+			memcpy(&hdr, secbuf, sizeof hdr);
+		nand_close();
+		/* New images go after the current one, spreading wear */
+		for (i=0; i<NAND_IMAGE_BLOCKS; i++)
+			if (valid_block(hdr.blocks[i]) && hdr.blocks[i]>wr.lastblock)
+				wr.lastblock=hdr.blocks[i];
+	}
+
+	info.lastBlockLba=TOTALSECS-1;
+	info.bytesPerBlock=SECTOR;
+	info.mediaPresent=g.blocks ? kUSBMSC_MEDIA_PRESENT : kUSBMSC_MEDIA_NOT_PRESENT;
+	info.mediaChanged=0;
+	info.writeProtected=0;
+	USBMSC_updateMediaInfo(0, &info);
+	USBMSC_registerBufInfo(0, secbuf, NULL, sizeof secbuf);
+}
+
+int nand_msc_service(void) {
+	USBMSC_RWbuf_Info *rw;
+	int i;
+
+	if (USBMSC_poll()==kUSBMSC_okToSleep)
+		return 0;
+	rw=USBMSC_fetchInfoStruct();
+	if (rw->operation!=kUSBMSC_READ && rw->operation!=kUSBMSC_WRITE)
+		return 1;
+	if (!expect_nandreq())
+		return 1;  // FLASH interface is using the chip, come back later
+
+	rw->returnCode=kUSBMSC_RWSuccess;
+	for (i=0; i<rw->lbCount; i++) {
+		uint8_t *p=rw->bufferAddr+i*SECTOR;
+		if (rw->operation==kUSBMSC_READ) {
+			if (read_sector(rw->lba+i, p)<0)
+				rw->returnCode=kUSBMSC_RWUnrecoveredRead;
+		} else if (write_sector(rw->lba+i, p)<0)
+			rw->returnCode=kUSBMSC_RWDevWriteFault;
+	}
+	nand_close();
+	USBMSC_bufferProcessed();
+	return 1;
+}
@@ -0,0 +1,10 @@
+/* USB mass storage view of the boot image, see nand_msc.c.
+   Only built with MSC=1 (defines USE_MSC). */
+
+/* Read the image header and describe the medium to the MSC stack.
+   Call after USB_init. */
+extern void nand_msc_init(void);
+/* Run the MSC state machine and serve sector reads and writes,
+   call from the main loop while enumerated. Returns nonzero while the
+   stack has more for us. */
+extern int nand_msc_service(void);
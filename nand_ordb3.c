@@ -2,18 +2,28 @@
 
 #include <USB_API/USB_Common/types.h>
 #include <USB_API/USB_HID_API/UsbHid.h>
+#include <descriptors.h>
+#include <usbConstructs.h>
 
 #include <stdint.h>
 #include <msp430.h>
 
-#include <safesleep.h>
+#include <sched.h>
 
 #include <nand_ordb3.h>
+#include <nand_ecc.h>
+#include <nand_ftl.h>
+#include <usbtxq.h>
+#include <stats.h>
+#include <trace.h>
+#include <boottime.h>
+
+#include <string.h>  /* for memcpy() */
+#include <HAL_FLASH.h>
 
 #define LIBXSVF
 #ifdef LIBXSVF
 #include <stdlib.h>  /* for realloc() */
-#include <string.h>  /* for memcpy() */
 #include <libxsvf.h>
 #include <jtag.h>    /* For libxsvf JTAG operations */
 #endif
@@ -68,6 +78,22 @@ static struct nandgeom {
 	uint8_t luns, addresscycles;
 } geom;
 static int colbits, rowbits;
+static uint8_t nand_id[5];	/* Manufacturer ID bytes from the probe */
+static uint8_t image_cached;	/* xsvf_nand_state.blocks holds page 0 */
+static int nand_bootcache_load(void);
+static void nand_bootcache_erase(void);
+static void nand_bootcache_save(void);
+static void nand_image_write(long block);
+
+/* Software ECC state, used when the chip has no on-die ECC.
+   ECC bytes for the whole page sit at the end of the spare area,
+   so the first spare bytes stay free for bad block markers. */
+enum nand_ecc_mode nand_ecc_mode;
+struct nand_ecc_stats nand_ecc_stats;
+#define MAXECCSTEPS 16	/* Enough for 4KiB pages */
+static uint8_t page_ecc[MAXECCSTEPS*NAND_ECC_BYTES];
+static uint8_t ecc_chunk[NAND_ECC_STEP];
+static int ecc_steps, ecc_offset;
 
 /*static inline*/ void nand_open(void) {
 	P5OUT |= CEn_BIT;
@@ -182,9 +208,21 @@ int nand_ready(void) {
 	return PJIN & R_Bn_BIT;
 }
 
+/* Account for a wait for R/Bn that began at start */
+static void nand_wait_done(uint32_t start) {
+	uint16_t d=stats_since(start);
+
+	stats.nand_wait+=d;
+	stats.nand_waits++;
+	if (d>stats.nand_wait_max)
+		stats.nand_wait_max=d;
+}
+
 int wait_for_nand_ready(void) {
 	unsigned int timeout=0xffff;  // Only there to ensure completion
 	uint8_t status;
+	uint32_t start=stats_now();
+	TRACE(TRACE_NAND_BUSY, 0);
 	// Await NAND ready, using read status polling
 	nand_CLE(1);
 	nand_write_byte(0x70); // Read status
@@ -195,6 +233,8 @@ int wait_for_nand_ready(void) {
 		status=P1IN;
 		P6OUT |= REn_BIT;
 	} while(((status&(1<<6))==0) && --timeout);
+	TRACE(TRACE_NAND_READY, 0);
+	nand_wait_done(start);
 	return timeout;  // non-0 if successful
 }
 
@@ -207,6 +247,55 @@ static void select_chip(int chip) {
 	}
 }
 
+/* Move the read pointer within the loaded page (Change Read Column) */
+static void nand_read_column(uint16_t col) {
+	int i;
+	nand_CLE(1);
+	nand_write_byte(0x05);
+	nand_CLE(0);
+	nand_ALE(1);
+	for (i=geom.addresscycles>>4; i--; col>>=8)
+		nand_write_byte(col);
+	nand_ALE(0);
+	nand_CLE(1);
+	nand_write_byte(0xe0);
+	nand_CLE(0);
+}
+
+/* Move the write pointer within the page register (Change Write Column) */
+static void nand_write_column(uint16_t col) {
+	int i;
+	nand_CLE(1);
+	nand_write_byte(0x85);
+	nand_CLE(0);
+	nand_ALE(1);
+	for (i=geom.addresscycles>>4; i--; col>>=8)
+		nand_write_byte(col);
+	nand_ALE(0);
+}
+
+/* Fetch the stored ECC of the loaded page, then rewind to column 0 */
+static void nand_fetch_page_ecc(void) {
+	nand_read_column(ecc_offset);
+	ordb3_nand_read_buf((char*)page_ecc, ecc_steps*NAND_ECC_BYTES);
+	nand_read_column(0);
+}
+
+/* Read the next ECC step of the loaded page into ecc_chunk, correcting it */
+static int nand_read_ecc_chunk(int step) {
+	uint8_t calc[NAND_ECC_BYTES];
+	int ret;
+
+	ordb3_nand_read_buf((char*)ecc_chunk, NAND_ECC_STEP);
+	nand_ecc_calculate(ecc_chunk, calc);
+	ret=nand_ecc_correct(ecc_chunk, page_ecc+step*NAND_ECC_BYTES, calc);
+	if (ret>0)
+		nand_ecc_stats.corrected++;
+	else if (ret<0)
+		nand_ecc_stats.failed++;
+	return ret;
+}
+
 char nand_read_status(void) {
 	nand_CLE(1);
 	nand_write_byte(0x70);
@@ -214,6 +303,62 @@ char nand_read_status(void) {
 	return ordb3_nand_read_byte();
 }
 
+/* Set features: Micron array operation mode, internal ECC on */
+static int nand_ecc_ondie_enable(void) {
+	int timeout;
+
+	nand_CLE(1);
+	nand_write_byte(0xef);  // set features
+	nand_CLE(0);
+	nand_ALE(1);
+	nand_write_byte(0x90);  // Micron array operation mode
+	nand_ALE(0);
+	nand_write_byte(0x08);  // Enable internal ECC
+	nand_write_byte(0x00);
+	nand_write_byte(0x00);
+	nand_write_byte(0x00);
+	for (timeout=-1; timeout && !nand_ready(); --timeout)
+		;  // Wait until flash chip ready
+	return nand_ready();
+}
+
+static void nand_read_id(uint8_t *id) {
+	nand_CLE(1);
+	nand_write_byte(0x90);  // Read ID
+	nand_CLE(0);
+	nand_ALE(1);
+	nand_write_byte(0x00);  // manufacturer ID region
+	nand_ALE(0);
+	ordb3_nand_read_buf((char*)id, sizeof nand_id);
+}
+
+/* Reset the chip and read its ID. On-die ECC is a volatile feature, so
+   it is turned back on if nand_ecc_mode says we use it. Returns 0 if
+   the chip does not get ready. */
+static int nand_reset_id(uint8_t *id) {
+	int timeout, tries=5;
+
+	nand_open();
+	select_chip(0);
+	for (timeout=-1; timeout && !nand_ready(); --timeout)
+		;  // Wait until flash chip ready
+	nand_CLE(1);
+	nand_write_byte(0xff);  // Reset
+	nand_CLE(0);
+	for (timeout=-1; timeout && !nand_ready(); --timeout)
+		;
+	if (!nand_ready())
+		return 0;
+	nand_read_id(id);
+	while (nand_ecc_mode==NAND_ECC_ONDIE && !(id[4]&0x80) && --tries) {
+		nand_ecc_ondie_enable();
+		nand_read_id(id);
+	}
+	return 1;
+}
+
+static void nand_geom_derive(void);
+
 int nand_probe(char *buf, int size) {
 	int tries=1+5, i, timeout;
 
@@ -266,15 +411,12 @@ int nand_probe(char *buf, int size) {
 		return 4;
 	}
 
+	/* Unless we manage to turn on the chip's own ECC, do it in software */
+	nand_ecc_mode=NAND_ECC_SOFT;
 	do {
 		/* Read ID vendor - to identify chip */
-		nand_CLE(1);
-		nand_write_byte(0x90);  // Read ID
-		nand_CLE(0);
-		nand_ALE(1);
-		nand_write_byte(0x00);  // manufacturer ID region
-		nand_ALE(0);
-		ordb3_nand_read_buf(buf+4, 5);
+		nand_read_id(nand_id);
+		memcpy(buf+4, nand_id, sizeof nand_id);
 
 		if (!(buf[4]==0x2c && buf[5]==0xda)) {
 			// MT29F1G08ABADA is 2c f1, MT29F2G08ABAEAH4 is 2c da
@@ -283,23 +425,13 @@ int nand_probe(char *buf, int size) {
 			break;  // Not the known chip, don't poke at vendor specific feature 
 		}
 
-		if (buf[4+4]&0x80)
+		if (buf[4+4]&0x80) {
+			nand_ecc_mode=NAND_ECC_ONDIE;
 			break;  // ECC is enabled
+		}
 
 		/* ECC is not enabled, try to enable it */
-		nand_CLE(1);
-		nand_write_byte(0xef);  // set features
-		nand_CLE(0);
-		nand_ALE(1);
-		nand_write_byte(0x90);  // Micron array operation mode
-		nand_ALE(0);
-		nand_write_byte(0x08);  // Enable internal ECC
-		nand_write_byte(0x00);
-		nand_write_byte(0x00);
-		nand_write_byte(0x00);
-		for (timeout=-1; timeout && !nand_ready(); --timeout)
-			;  // Wait until flash chip ready
-		if (!nand_ready())
+		if (!nand_ecc_ondie_enable())
 			return 5;
 	} while (--tries);
 
@@ -324,6 +456,14 @@ int nand_probe(char *buf, int size) {
 		ordb3_nand_read_byte();
 	}
 	ordb3_nand_read_buf((void*)&geom, sizeof geom);
+	nand_geom_derive();
+	return 4+1+32;
+}
+
+/* Address and ECC layout from geom */
+static void nand_geom_derive(void) {
+	int i;
+
 	colbits=0;
 	for (i=1; i<geom.pagesperblock; i<<=1)
 		colbits++;
@@ -332,26 +472,57 @@ int nand_probe(char *buf, int size) {
 		rowbits++;
 	for (i=1; i<geom.luns; i<<=1)
 		rowbits++;
-	return 4+1+32;
+	ecc_steps=geom.bytesperpage/NAND_ECC_STEP;
+	ecc_offset=geom.bytesperpage+geom.sparebytesperpage-ecc_steps*NAND_ECC_BYTES;
+	if (nand_ecc_mode==NAND_ECC_SOFT &&
+	    (ecc_steps>MAXECCSTEPS || ecc_offset<geom.bytesperpage+2))
+		nand_ecc_mode=NAND_ECC_NONE;  // No room for it, leave data raw
 }
 
 static int nandreport_size;
 static char nandreport[61];
 void Do_NAND_Probe(void) {
+	static uint8_t booted;
+
+	image_cached = 0;
+	if (nand_bootcache_load()) {
+		boottime.nand_cached=1;
+		memcpy(nandreport, "ONFI", 4);
+		memcpy(nandreport+4, nand_id, sizeof nand_id);
+		nandreport_size = 4+sizeof nand_id;
+		return;
+	}
+	if (!booted++)
+		nand_bootcache_erase();  // USB and the UART are not up yet
 	nandreport_size = nand_probe(nandreport, sizeof nandreport);
 }
 
+int nand_resume(void) {
+	uint8_t id[sizeof nand_id];
+
+	if (nand_reset_id(id) && nandreport_size &&
+	    memcmp(id, nand_id, sizeof id) == 0)
+		return 1;
+	/* Another chip, or it did not come back right: start over */
+	Do_NAND_Probe();
+	return 0;
+}
+
 
 #ifdef LIBXSVF
 /* XSVF player connection */
 
-#define MAXBLOCKS 32
+#define MAXBLOCKS NAND_IMAGE_BLOCKS
 struct xsvfnand_state {
 	//enum { disconnect, idle, reading, erasing, writing } state;
 	long blocks[MAXBLOCKS];	// List of blocks holding XSVF data
 	int bytesleftinpage, pageinblock, blockinlist;
+	int eccstep, chunkleft;	// Only used with software ECC
 } xsvf_nand_state;
 
+struct fpga_config_status fpga_config;
+static int fpga_yield(void);
+
 // TODO: Find out if libxsvf might be improved to support async reading.
 // (in short: not easily. it does read in command chunks though, so 
 // perhaps we can break the loop.)
@@ -388,6 +559,12 @@ static int xsvf_shutdown(struct libxsvf_host *h);
 static int xsvf_setup(struct libxsvf_host *h) {
 	nand_open();
 
+	// Load page 0 for block list, unless we have it from last time.
+	// Before taking R/Bn, which nand_page_read would let go again.
+	if (!image_cached)
+		nand_image_hdr_read(xsvf_nand_state.blocks,
+				    sizeof(xsvf_nand_state.blocks));
+
 	// XSVF programming may cause FPGA to start reading NAND, 
 	// so we keep the busy line asserted while we need the NAND
 	PJOUT &= ~R_Bn_BIT;
@@ -396,18 +573,26 @@ static int xsvf_setup(struct libxsvf_host *h) {
 	xsvf_nand_state.bytesleftinpage=geom.bytesperpage;
 	xsvf_nand_state.pageinblock=2;
 	xsvf_nand_state.blockinlist=0;
-	
-	// Load page 0 for block list
-	nand_loadpage(0, Uncached);
-	ordb3_nand_read_buf((void*)&xsvf_nand_state.blocks,
-			    sizeof(xsvf_nand_state.blocks));
 
 	/* Sanity check: first block is valid and not 0 */
 	if (xsvf_nand_state.blocks[0]<=0 ||
 	    xsvf_nand_state.blocks[0]>=geom.blocksperlun*geom.luns) {
+		image_cached=0;
+		nand_bootcache_save();  // Geometry at least
 		xsvf_shutdown(h);
 		return -1;
 	}
+	image_cached=1;
+	nand_bootcache_save();
+
+	if (nand_ecc_mode==NAND_ECC_SOFT) {
+		/* Cache reads don't mix with hopping to the spare area for ECC,
+		   so xsvf_getbyte_soft loads one page at a time instead. */
+		xsvf_nand_state.pageinblock=0;
+		xsvf_nand_state.eccstep=ecc_steps;
+		xsvf_nand_state.chunkleft=0;
+		return 0;
+	}
 
 	/* Start loading first page */
 	nand_loadpage(xsvf_nand_state.blocks[0]*geom.pagesperblock,Cached);
@@ -426,13 +611,49 @@ static int xsvf_shutdown(struct libxsvf_host *h) {
 	return 0;
 }
 
+static int xsvf_pulse_tck(struct libxsvf_host *h, int tms, int tdi, int tdo, int rmask, int sync) {
+	fpga_config.tcks++;
+	return pulse_tck(h,tms,tdi,tdo,rmask,sync);
+}
+
 static void xsvf_udelay(struct libxsvf_host *h, long usecs, int tms, long num_tck) {
+	fpga_config.tcks+=num_tck;
 	while (num_tck--) {
 		pulse_tck(h,tms,-1,-1,0,0);
 	}
 }
 
+static int xsvf_getbyte_soft(void) {
+	if (!xsvf_nand_state.chunkleft) {
+		if (xsvf_nand_state.eccstep==ecc_steps) {
+			/* Need to start on a new page */
+			int bil=xsvf_nand_state.blockinlist;
+			nand_loadpage(xsvf_nand_state.blocks[bil]*geom.pagesperblock+
+				      xsvf_nand_state.pageinblock, Uncached);
+			nand_fetch_page_ecc();
+			xsvf_nand_state.eccstep=0;
+			if (++xsvf_nand_state.pageinblock>=geom.pagesperblock) {
+				/* New block */
+				if (bil+1<MAXBLOCKS) {
+					xsvf_nand_state.blockinlist=bil+1;
+					xsvf_nand_state.pageinblock=0;
+				} else {
+					/* End of block list, stay inside the image */
+					xsvf_nand_state.pageinblock--;  // Repeat last page
+				}
+			}
+		}
+		nand_read_ecc_chunk(xsvf_nand_state.eccstep++);
+		xsvf_nand_state.chunkleft=NAND_ECC_STEP;
+	}
+	return ecc_chunk[NAND_ECC_STEP-xsvf_nand_state.chunkleft--];
+}
+
 static int xsvf_getbyte(struct libxsvf_host *h) {
+	if (!(++fpga_config.bytes&0xff) && fpga_yield())
+		return -1;  // Stopped; libxsvf gives up at end of data
+	if (nand_ecc_mode==NAND_ECC_SOFT)
+		return xsvf_getbyte_soft();
 	if (!--xsvf_nand_state.bytesleftinpage) {
 		int byte=ordb3_nand_read_byte();
 		/* Need to start on a new page */
@@ -486,21 +707,397 @@ struct libxsvf_host xsvf_host={
 	.shutdown=xsvf_shutdown,
 	.udelay=xsvf_udelay,
 	.getbyte=xsvf_getbyte,
-	.pulse_tck=pulse_tck,
+	.pulse_tck=xsvf_pulse_tck,
 	.report_error=xsvf_report_error,
 	.realloc=xsvf_realloc,
 };
 
+/* Background configuration. libxsvf pulls its input through
+   xsvf_getbyte and has no way to stop halfway, so the player runs to
+   the end on the caller's stack, and every 256 bytes xsvf_getbyte
+   calls back into the main loop instead. The NAND stays open and JTAG
+   busy in between; main loop users of either check fpga_config.state
+   first. Once the callback returns nonzero, xsvf_getbyte reports end
+   of data and the player fails out. */
+static int (*fpga_background)(void);
+static uint8_t fpga_stopped;
+
+static int fpga_yield(void) {
+	if (fpga_background && !fpga_stopped)
+		fpga_stopped=fpga_background()!=0;
+	return fpga_stopped;
+}
+
+void fpga_config_start(void) {
+	fpga_config.state=FPGA_CONFIG_BUSY;
+	fpga_config.result=0;
+	fpga_config.bytes=0;
+	fpga_config.tcks=0;
+}
+
+int fpga_config_run(int (*background)(void)) {
+	if (fpga_config.state!=FPGA_CONFIG_BUSY)
+		return fpga_config.result;
+	fpga_background=background;
+	fpga_stopped=0;
+	fpga_config.result=libxsvf_play(&xsvf_host, LIBXSVF_MODE_XSVF);
+	if (fpga_stopped)
+		fpga_config.result=-1;
+	fpga_config.state=fpga_config.result<0 ? FPGA_CONFIG_FAILED :
+		FPGA_CONFIG_DONE;
+	return fpga_config.result;
+}
+
 int program_fpga_from_nand(void) {
-	return libxsvf_play(&xsvf_host, LIBXSVF_MODE_XSVF);
+	fpga_config_start();
+	return fpga_config_run(NULL);
 }
 
 #endif
 
+/* Boot cache: the probe results, ECC mode and image block list, kept
+   in info flash segment B. A boot with the same chip then needs one
+   reset and ID read, instead of the probe, parameter page and page 0.
+   Blocks are kept in 16 bits (0xffff for -1); a list that does not fit
+   is left out. Any write to page 0 or the image clears the magic.
+   Erasing the segment stalls the CPU for some 25ms, which USB and the
+   UART cannot afford, so a stale cache is only erased at boot. */
+#define BOOTCACHE_MAGIC 0x4e31	/* Change with the layout */
+struct nand_bootcache {
+	uint16_t magic;
+	uint8_t id[sizeof nand_id];
+	uint8_t ecc_mode;
+	struct nandgeom geom;
+	uint16_t blocks[NAND_IMAGE_BLOCKS];	/* blocks[0]==0: not kept */
+	uint16_t check;
+};
+static const struct nand_bootcache * const bootcache =
+	(const struct nand_bootcache *)0x1900;	/* INFOB */
+
+static uint16_t nand_bootcache_sum(const struct nand_bootcache *c) {
+	const uint16_t *p=(const uint16_t *)c;
+	uint16_t sum=0;
+
+	while (p<&c->check)
+		sum+=*p++;
+	return sum;
+}
+
+static int nand_bootcache_load(void) {
+	const struct nand_bootcache *c=bootcache;
+	uint8_t id[sizeof nand_id];
+	int i;
+
+	if (c->magic!=BOOTCACHE_MAGIC || c->check!=nand_bootcache_sum(c))
+		return 0;
+	nand_ecc_mode=c->ecc_mode;
+	if (!nand_reset_id(id) || memcmp(id, c->id, sizeof id))
+		return 0;  // Different chip, probe it
+	memcpy(nand_id, id, sizeof id);
+	geom=c->geom;
+	nand_geom_derive();
+#ifdef LIBXSVF
+	if (c->blocks[0]) {
+		for (i=0; i<NAND_IMAGE_BLOCKS; i++)
+			xsvf_nand_state.blocks[i] = c->blocks[i]==0xffff ? -1 :
+				c->blocks[i];
+		image_cached=1;
+	}
+#endif
+	return 1;
+}
+
+static int nand_bootcache_blank(void) {
+	const uint16_t *p=(const uint16_t *)bootcache;
+
+	while (p<(const uint16_t *)(bootcache+1))
+		if (*p++!=0xffff)
+			return 0;
+	return 1;
+}
+
+static void nand_bootcache_invalidate(void) {
+	uint16_t zero=0;
+
+	if (bootcache->magic==BOOTCACHE_MAGIC)
+		FlashWrite_16(&zero, (uint16_t *)&bootcache->magic, 1);
+}
+
+/* From Do_NAND_Probe at boot, when the cache did not match */
+static void nand_bootcache_erase(void) {
+	if (!nand_bootcache_blank())
+		Flash_SegmentErase((uint16_t *)bootcache);
+}
+
+/* Write the cache if it differs. That takes word writes into a blank
+   segment only; a different cache is invalidated instead, for the next
+   boot to erase and this to write again. */
+static void nand_bootcache_save(void) {
+	static struct nand_bootcache c;
+	int i;
+
+	memset(&c, 0, sizeof c);
+	c.magic=BOOTCACHE_MAGIC;
+	memcpy(c.id, nand_id, sizeof c.id);
+	c.ecc_mode=nand_ecc_mode;
+	c.geom=geom;
+#ifdef LIBXSVF
+	for (i=0; image_cached && i<NAND_IMAGE_BLOCKS; i++) {
+		long b=xsvf_nand_state.blocks[i];
+		if (b<-1 || b>=0xffff) {
+			c.blocks[0]=0;
+			break;
+		}
+		c.blocks[i]=b;
+	}
+#endif
+	c.check=nand_bootcache_sum(&c);
+	if (!memcmp(&c, bootcache, sizeof c))
+		return;
+	if (!nand_bootcache_blank()) {
+		nand_bootcache_invalidate();
+		return;
+	}
+	FlashWrite_16((uint16_t *)&c, (uint16_t *)bootcache, sizeof c/2);
+}
+
+/* A program or erase is about to touch block (-1: unknown). Forget the
+   image if it is page 0's block or one of the image's. */
+static void nand_image_write(long block) {
+#ifdef LIBXSVF
+	int i;
+
+	if (image_cached && block>0) {
+		for (i=0; i<NAND_IMAGE_BLOCKS; i++)
+			if (xsvf_nand_state.blocks[i]==block)
+				break;
+		if (i==NAND_IMAGE_BLOCKS)
+			return;
+	}
+#endif
+	image_cached=0;
+	nand_bootcache_invalidate();
+}
+
+/* Page helpers, see nand_ordb3.h */
+static void nand_command(uint8_t cmd) {
+	nand_CLE(1);
+	nand_write_byte(cmd);
+	nand_CLE(0);
+}
+
+static void nand_address(uint16_t col, uint32_t row) {
+	int i;
+	nand_ALE(1);
+	for (i=geom.addresscycles>>4; i--; col>>=8)
+		nand_write_byte(col);
+	for (i=ROWBYTES; i--; row>>=8)
+		nand_write_byte(row);
+	nand_ALE(0);
+}
+
+/* Wait for an operation to finish, then check its status */
+static int nand_finish_status(void) {
+	if (!wait_for_nand_ready())
+		return -1;
+	return (ordb3_nand_read_byte()&1) ? -1 : 0;  // Still in read status
+}
+
+void nand_get_geometry(struct nand_geometry *g) {
+	g->pagebytes=geom.bytesperpage;
+	g->pagesperblock=geom.pagesperblock;
+	g->sparebytes=geom.sparebytesperpage;
+	g->blocks=geom.blocksperlun*geom.luns;
+}
+
+int nand_page_read(uint32_t row, uint16_t col, void *buf, int len) {
+	uint8_t *p=buf;
+	int ret=0;
+
+	nand_open();
+	wait_for_nand_ready();
+	nand_command(0x00);
+	nand_address(0, row);
+	nand_command(0x30);
+	if (!wait_for_nand_ready())
+		return -1;
+	if (nand_ecc_mode==NAND_ECC_ONDIE && (ordb3_nand_read_byte()&1))
+		ret=-1;  // Chip could not correct the page
+	nand_command(0x00);  // Back to data output
+
+	if (nand_ecc_mode==NAND_ECC_SOFT && col<geom.bytesperpage) {
+		nand_fetch_page_ecc();
+		nand_read_column(col);
+		for (; len>0; len-=NAND_ECC_STEP, p+=NAND_ECC_STEP) {
+			if (nand_read_ecc_chunk(col/NAND_ECC_STEP)<0)
+				ret=-1;
+			memcpy(p, ecc_chunk, len<NAND_ECC_STEP?len:NAND_ECC_STEP);
+			col+=NAND_ECC_STEP;
+		}
+	} else {
+		if (col)
+			nand_read_column(col);
+		ordb3_nand_read_buf((char*)p, len);
+	}
+	return ret;
+}
+
+int nand_image_hdr_read(void *buf, int len) {
+	const long *first=buf;
+
+	if (nand_page_read(0, 0, buf, len)==0 &&
+	    *first>0 && *first<geom.blocksperlun*geom.luns)
+		return 0;
+	return nand_page_read((uint32_t)NAND_HDR_BACKUP*geom.pagesperblock,
+			      0, buf, len);
+}
+
+void nand_page_program_start(uint32_t row) {
+	nand_image_write(row/geom.pagesperblock);
+	nand_open();
+	nand_enable_write();
+	wait_for_nand_ready();
+	memset(page_ecc, 0xff, sizeof page_ecc);  // ECC of erased steps
+	nand_command(0x80);
+	nand_address(0, row);
+}
+
+void nand_page_program_data(uint16_t col, const void *buf, int len) {
+	const uint8_t *p=buf;
+
+	nand_write_column(col);
+	ordb3_nand_write_buf((const char*)p, len);
+	if (nand_ecc_mode==NAND_ECC_SOFT)
+		for (; len>=NAND_ECC_STEP && col<geom.bytesperpage;
+		     len-=NAND_ECC_STEP, p+=NAND_ECC_STEP, col+=NAND_ECC_STEP)
+			nand_ecc_calculate(p, page_ecc+
+					   col/NAND_ECC_STEP*NAND_ECC_BYTES);
+}
+
+int nand_page_program_finish(void) {
+	if (nand_ecc_mode==NAND_ECC_SOFT) {
+		nand_write_column(ecc_offset);
+		ordb3_nand_write_buf((char*)page_ecc, ecc_steps*NAND_ECC_BYTES);
+	}
+	nand_command(0x10);
+	return nand_finish_status();
+}
+
+int nand_block_erase(uint32_t block) {
+	uint32_t row=block*geom.pagesperblock;
+	int i;
+
+	nand_image_write(block);
+	nand_open();
+	nand_enable_write();
+	wait_for_nand_ready();
+	nand_command(0x60);
+	nand_ALE(1);
+	for (i=ROWBYTES; i--; row>>=8)
+		nand_write_byte(row);
+	nand_ALE(0);
+	nand_command(0xd0);
+	return nand_finish_status();
+}
+
+/* Factory bad block marker: first spare byte of the first page */
+int nand_block_bad(uint32_t block) {
+	nand_open();
+	wait_for_nand_ready();
+	nand_command(0x00);
+	nand_address(geom.bytesperpage, block*geom.pagesperblock);
+	nand_command(0x30);
+	if (!wait_for_nand_ready())
+		return 1;
+	nand_command(0x00);
+	return ordb3_nand_read_byte()!=0xff;
+}
+
+/* Micron parts with on-die ECC protect bytes 4..7 of each 16 byte spare
+   section. Our software ECC fills the spare area from the end. */
+uint16_t nand_tag_column(int n) {
+	if (nand_ecc_mode==NAND_ECC_ONDIE)
+		return geom.bytesperpage+16*n+4;
+	return geom.bytesperpage+2+4*n;
+}
+
+/* Software ECC on the host request path. A program (0x80) starting at
+   column 0 gets its ECC appended just before the confirm (0x10) if the
+   host wrote exactly one page of data; anything else is left raw, so
+   the host can still write spare areas itself. Likewise a page read
+   (0x00 ... 0x30) from column 0 is corrected step by step. */
+static struct {
+	uint8_t cmd;		/* 0x00 or 0x80 while an address is pending */
+	uint8_t addridx;	/* Address cycles seen so far */
+	uint8_t reading;	/* Serving corrected data from ecc_chunk */
+	uint16_t col;		/* Column address given by host */
+	uint16_t pos;		/* Bytes of page data streamed */
+	struct nand_ecc_ctx ctx;
+} rawecc;
+
+static void rawecc_track_addr(const char *data, int len) {
+	while (len-- && rawecc.addridx<(geom.addresscycles>>4))
+		rawecc.col |= (uint16_t)(uint8_t)*data++ << (8*rawecc.addridx++);
+}
+
+static void rawecc_track_write(const char *data, int len) {
+	while (len && rawecc.pos<geom.bytesperpage) {
+		int n = NAND_ECC_STEP-(rawecc.pos%NAND_ECC_STEP);
+		if (n>len) n=len;
+		nand_ecc_update(&rawecc.ctx, (const uint8_t*)data, n);
+		rawecc.pos+=n;
+		data+=n;
+		len-=n;
+		if (rawecc.pos%NAND_ECC_STEP==0) {
+			nand_ecc_final(&rawecc.ctx, page_ecc+
+				       (rawecc.pos/NAND_ECC_STEP-1)*NAND_ECC_BYTES);
+			nand_ecc_init(&rawecc.ctx);
+		}
+	}
+	if (len)
+		rawecc.cmd=0;  // Host writes past the page, leave it raw
+}
+
+static int rawecc_produce(char *data, int len) {
+	int off = rawecc.pos%NAND_ECC_STEP;
+	if (rawecc.pos==0)
+		nand_fetch_page_ecc();
+	if (off==0)
+		nand_read_ecc_chunk(rawecc.pos/NAND_ECC_STEP);
+	if (len>NAND_ECC_STEP-off)
+		len=NAND_ECC_STEP-off;
+	memcpy(data, ecc_chunk+off, len);
+	rawecc.pos+=len;
+	if (rawecc.pos>=geom.bytesperpage)
+		rawecc.reading=0;  // Spare area follows, read it raw
+	return len;
+}
+
+static uint8_t nand_raw;  /* Set for v2 requests with NANDREQ2_RAW */
+
 void process_nandreq(void) {
+	uint8_t cmd=nand_state.cmd;
+
+	if (cmd==0x80 || cmd==0x60)
+		nand_image_write(-1);  // Host is writing, the image may change
 	nand_open();
+	if (nand_ecc_mode==NAND_ECC_SOFT) {
+		if (cmd==0x10 && rawecc.cmd==0x80 && rawecc.col==0 &&
+		    rawecc.pos==geom.bytesperpage && !nand_raw) {
+			nand_write_column(ecc_offset);
+			ordb3_nand_write_buf((char*)page_ecc,
+					     ecc_steps*NAND_ECC_BYTES);
+		}
+		rawecc.reading = cmd==0x30 && rawecc.cmd==0x00 && rawecc.col==0 &&
+			!nand_raw;
+		rawecc.cmd=nand_raw ? 0xff : cmd;
+		rawecc.addridx=0;
+		rawecc.col=0;
+		rawecc.pos=0;
+		nand_ecc_init(&rawecc.ctx);
+	}
 	nand_CLE(1);
-	nand_write_byte(nand_state.cmd);
+	nand_write_byte(cmd);
 	nand_CLE(0);
 }
 void process_nanddata(char *data, int len) {
@@ -512,6 +1109,8 @@ void process_nanddata(char *data, int len) {
 		nand_ALE(1);
 		ordb3_nand_write_buf(data, alen);
 		nand_ALE(0);
+		if (rawecc.cmd==0x00 || rawecc.cmd==0x80)
+			rawecc_track_addr(data, alen);
 
 		len-=alen;
 		nand_state.addr_bytes-=alen;
@@ -521,6 +1120,8 @@ void process_nanddata(char *data, int len) {
 		int wrlen = nand_state.writelen;
 		if (len<wrlen) wrlen=len;
 		ordb3_nand_write_buf(data, wrlen);
+		if (rawecc.cmd==0x80 && rawecc.col==0)
+			rawecc_track_write(data, wrlen);
 		nand_state.writelen-=wrlen;
 	}
 }
@@ -528,12 +1129,194 @@ int produce_nanddata(char *data, int len) {
 	if (len>nand_state.readlen)
 		len=nand_state.readlen;
 	if (len) {
-		ordb3_nand_read_buf(data, len);
+		if (rawecc.reading)
+			len=rawecc_produce(data, len);
+		else
+			ordb3_nand_read_buf(data, len);
 		nand_state.readlen-=len;
 	}
 	return len;
 }
 
+/* FLASH interface request stream */
+static struct {
+	uint8_t stream;		/* Host speaks v2, keep partial headers */
+	uint8_t active;		/* A v2 request awaits its completion record */
+	uint8_t seq, flags;
+	uint8_t ticks;		/* Latency timer ticks spent waiting for R/Bn */
+	uint8_t busy;		/* Saw R/Bn low at busy_since */
+	uint32_t busy_since;
+	uint8_t hdrlen;
+	uint8_t ftl;		/* Request goes to the FTL (NANDREQ2_FTL) */
+	uint16_t moved;
+	struct nand_ecc_stats ecc;	/* Counters at start of request */
+	struct nandreq2 hdr;
+	uint8_t pending;	/* compl waits for room in the queue */
+	struct nandcompl compl;
+} nandusb;
+
+/* Queue the completion record once there is room. Records may straddle
+   packets, the host sees a byte stream. */
+static int nand_usb_emit(void) {
+	if (nandusb.pending &&
+	    usbtxq_space(FLASH_INTFNUM)>=sizeof nandusb.compl) {
+		usbtxq_write(FLASH_INTFNUM, &nandusb.compl, sizeof nandusb.compl);
+		nandusb.pending=0;
+	}
+	return nandusb.pending;
+}
+
+static void nand_usb_complete(uint8_t result) {
+	struct nandcompl *c=&nandusb.compl;
+	uint16_t corrected=nand_ecc_stats.corrected-nandusb.ecc.corrected;
+
+	c->seq=nandusb.seq;
+	c->result=result;
+	c->status=0;
+	if (result==NANDRES_OK && (nandusb.flags&NANDREQ2_STATUS) && !nandusb.ftl)
+		c->status=nand_read_status();
+	c->ecc=corrected>0x7f ? 0x7f : corrected;
+	if (nand_ecc_stats.failed!=nandusb.ecc.failed)
+		c->ecc|=0x80;
+	c->moved=nandusb.moved;
+	nandusb.active=0;
+	nandusb.pending=1;
+	nand_usb_emit();
+}
+
+/* A whole header has been collected in nandusb.hdr */
+static void nand_usb_start(int len) {
+	int v2=(nandusb.hdr.req.addr_bytes&NANDREQ2_SIGMASK)==NANDREQ2_SIG;
+
+	nand_state=nandusb.hdr.req;
+	nandusb.hdrlen=0;
+	nandusb.stream=v2;
+	if (v2) {
+		nand_state.addr_bytes&=~NANDREQ2_SIGMASK;
+		nandusb.active=1;
+		nandusb.seq=nandusb.hdr.seq;
+		nandusb.flags=nandusb.hdr.flags;
+		nandusb.ticks=0;
+		nandusb.moved=0;
+		nandusb.ecc=nand_ecc_stats;
+	}
+	/* Unlock flash */
+	nand_enable_write();  // raise WPn
+	nandusb.ftl=v2 && (nandusb.flags&NANDREQ2_FTL);
+	// Simple validation for now
+	if (nandusb.ftl ? ftl_request_start()==0 :
+	    nand_state.addr_bytes<8 && !(nand_state.writelen&&nand_state.readlen)) {
+		if (!nandusb.ftl) {
+			nand_raw=v2 && (nandusb.flags&NANDREQ2_RAW);
+			process_nandreq();
+		}
+	} else {
+		// Invalid command, flush the buffer
+		char buf[MAX_PACKET_SIZE];
+		while (len>0) {
+			int got=hidReceiveDataInBuffer((BYTE*)buf,
+				len<sizeof buf?len:sizeof buf, FLASH_INTFNUM);
+			if (!got)
+				break;
+			len-=got;
+		}
+		nand_state.addr_bytes=0;
+		nand_state.writelen=0;
+		nand_state.readlen=0;
+		if (v2) {
+			nand_usb_complete(NANDRES_BADREQ);
+			nandusb.stream=0;
+		}
+	}
+}
+
+int nand_usb_service(void) {
+	int len;
+	char buf[MAX_PACKET_SIZE];
+
+	if (!nand_ready()) {
+		if (!nandusb.busy) {
+			nandusb.busy=1;
+			nandusb.busy_since=stats_now();
+			TRACE(TRACE_NAND_BUSY, 0);
+		}
+	} else if (nandusb.busy) {
+		nandusb.busy=0;
+		TRACE(TRACE_NAND_READY, 0);
+		nand_wait_done(nandusb.busy_since);
+	}
+	/* A completion the host has no room for yet holds everything back */
+	if (!nand_usb_emit() && nand_ready()) {
+		nandusb.ticks=0;
+		if (nandusb.active && !nand_state.addr_bytes &&
+		    !nand_state.writelen && !nand_state.readlen)
+			nand_usb_complete(nandusb.ftl && ftl_request_failed() ?
+					  NANDRES_FAILED : NANDRES_OK);  // Before nand_close()
+		if (!nandusb.pending && expect_nandreq()) {
+			len=USBHID_bytesInUSBBuffer(FLASH_INTFNUM);
+			if (len && (nandusb.stream || nandusb.hdrlen ||
+				    len>=sizeof(struct nandreq))) {
+				/* v1 header first, then the v2 tail if signed */
+				int want=(nandusb.hdrlen<sizeof(struct nandreq) ?
+					  sizeof(struct nandreq) :
+					  sizeof(struct nandreq2))-nandusb.hdrlen;
+				int got=hidReceiveDataInBuffer(
+					(BYTE*)&nandusb.hdr+nandusb.hdrlen,
+					want<len?want:len, FLASH_INTFNUM);
+				nandusb.hdrlen+=got;
+				len-=got;
+				if (nandusb.hdrlen==sizeof(struct nandreq2) ||
+				    (nandusb.hdrlen==sizeof(struct nandreq) &&
+				     (nandusb.hdr.req.addr_bytes&NANDREQ2_SIGMASK)!=NANDREQ2_SIG))
+					nand_usb_start(len);
+			} else if (len) {
+				// Too small a packet, discard the data
+				hidReceiveDataInBuffer((BYTE*)buf, len, FLASH_INTFNUM);
+			}
+		} else if ((len=expect_nanddata())) {  // Yes, this is an assignment
+			len=hidReceiveDataInBuffer((BYTE*)buf,
+						   sizeof(buf)<len?sizeof(buf):len,
+						   FLASH_INTFNUM);
+			if (len) {
+				if (nandusb.ftl)
+					ftl_request_data(buf, len);
+				else
+					process_nanddata(buf, len);
+				nandusb.moved+=len;
+			}
+		} else if (nand_state.readlen) {
+			len=usbtxq_space(FLASH_INTFNUM);
+			if (len>sizeof buf)
+				len=sizeof buf;
+			len=(nandusb.ftl ? ftl_request_produce : produce_nanddata)(
+				buf, len);
+			usbtxq_write(FLASH_INTFNUM, buf, len);
+			nandusb.moved+=len;
+		}
+	}
+	if (nand_state.readlen || nandusb.active || nandusb.pending ||
+	    USBHID_bytesInUSBBuffer(FLASH_INTFNUM))
+		return 1;  /* Waiting for NAND or the host, come back */
+	if (!nandusb.hdrlen)
+		usbtxq_flush(FLASH_INTFNUM);  /* Out of requests, don't hold replies back */
+	return 0;
+}
+
+void nand_usb_tick(void) {
+	if (nandusb.active && !nand_ready() &&
+	    ++nandusb.ticks>=NAND_TIMEOUT_TICKS) {
+		/* Stuck busy; abort whatever the chip is doing */
+		nand_CLE(1);
+		nand_write_byte(0xff);
+		nand_CLE(0);
+		nand_state.addr_bytes=0;
+		nand_state.writelen=0;
+		nand_state.readlen=0;
+		nand_usb_complete(NANDRES_TIMEOUT);
+	}
+	usbtxq_flush(FLASH_INTFNUM);
+}
+
 /*
  * Port 1 interrupt vector
  *
@@ -550,7 +1333,7 @@ __interrupt void PORT1_ISR (void)
 		// That is not for the flash, read it
 		bCommand = P1IN | BIT7;  // Use bit 7 to indicate new command
 		// Wake main thread up
-		WAKEUP_IRQ(LPM3_bits);
+		SCHED_POST_IRQ(TASK_FPGACMD);
 	}
 }
 
@@ -2,15 +2,52 @@
    Then addr_bytes worth of address, writelen worth of write data,
    finally expect to produce readlen bytes of return data. */
 
-/* Need to extend protocol with a result: timeout, finished, data.
-   Might also want a signature word for synchronization. */
-
 extern struct nandreq {
 	uint8_t cmd;
 	uint8_t addr_bytes;
 	uint16_t writelen, readlen;
 } nand_state;
 
+/* Protocol v2: NANDREQ2_SIG in the top bits of addr_bytes (v1 only
+   allows 0..7 there) marks a request followed by a sequence number and
+   flags. Any number of requests may be packed back to back in one
+   transfer. Once a request is done, after its read data if any, a
+   struct nandcompl is returned. Replies are packed into full packets;
+   a partial one goes out when we run out of requests or on the latency
+   timer. A malformed request flushes the OUT buffer and is answered with
+   NANDRES_BADREQ, so the host knows where to resume. */
+#define NANDREQ2_SIG 0xa8
+#define NANDREQ2_SIGMASK 0xf8
+struct nandreq2 {
+	struct nandreq req;
+	uint8_t seq;
+	uint8_t flags;
+};
+#define NANDREQ2_STATUS	0x01	/* Read status register at completion */
+#define NANDREQ2_RAW	0x02	/* Bypass software ECC for this request */
+#define NANDREQ2_FTL	0x04	/* Logical sector access, see nand_ftl.h */
+
+struct nandcompl {
+	uint8_t seq;
+	uint8_t result;		/* NANDRES_* */
+	uint8_t status;		/* Status register if NANDREQ2_STATUS, else 0 */
+	uint8_t ecc;		/* ECC steps corrected, bit 7 if any failed */
+	uint16_t moved;		/* Bytes of address, write and read data */
+};
+enum { NANDRES_OK, NANDRES_TIMEOUT, NANDRES_BADREQ, NANDRES_FAILED };
+
+/* Waiting this many latency timer ticks for R/Bn resets the chip */
+#define NAND_TIMEOUT_TICKS 32
+
+/* How page data is protected, decided by nand_probe. With software ECC,
+   page reads and programs through the request path are corrected and
+   given ECC transparently (see process_nandreq). */
+enum nand_ecc_mode { NAND_ECC_NONE, NAND_ECC_ONDIE, NAND_ECC_SOFT };
+extern enum nand_ecc_mode nand_ecc_mode;
+extern struct nand_ecc_stats {
+	uint16_t corrected, failed;
+} nand_ecc_stats;
+
 /* Indicates that we're waiting for a new request. */
 void nand_close(void);
 
@@ -26,13 +63,78 @@ static inline int expect_nanddata(void) {
 }
 /* R/Bn line; each step waits for it to be high. */
 extern int nand_ready(void);
+/* After the NAND lost power: reset it, check its ID against the probe
+   and turn its ECC back on, keeping the probed geometry and the image
+   block list. Probes afresh (and returns 0) if the chip differs. */
+extern int nand_resume(void);
 /* Tell the NAND block to process a fresh request. */
 extern void process_nandreq(void);
 /* Feed the NAND block data from USB, be it address or write */
 extern void process_nanddata(char *data, int len);
 /* Read data from NAND to send over USB */
 extern int produce_nanddata(char *data, int maxlen);
-/* Program FPGA from NAND data */
+/* Run the FLASH interface, call from the main loop while enumerated.
+   Returns nonzero while waiting for the chip or the host. */
+extern int nand_usb_service(void);
+/* Latency timer tick: flush partial replies, time out busy requests */
+extern void nand_usb_tick(void);
+
+/* Page access for code on our side of the chip (mass storage). Rows are
+   absolute page numbers. With software ECC, columns and lengths must be
+   multiples of NAND_ECC_STEP. Reads return -1 on uncorrectable data,
+   program and erase return -1 on failure. The chip is left open; call
+   these only while expect_nandreq() holds, and nand_close() after. */
+struct nand_geometry {
+	uint16_t pagebytes;
+	uint16_t pagesperblock;
+	uint16_t sparebytes;
+	uint32_t blocks;	/* 0 if no chip was found */
+};
+extern void nand_get_geometry(struct nand_geometry *g);
+extern int nand_page_read(uint32_t row, uint16_t col, void *buf, int len);
+extern void nand_page_program_start(uint32_t row);
+extern void nand_page_program_data(uint16_t col, const void *buf, int len);
+extern int nand_page_program_finish(void);
+extern int nand_block_erase(uint32_t block);
+extern int nand_block_bad(uint32_t block);
+/* Column of four spare bytes free for the user of 512 byte sector n of
+   a page: covered by the on-die ECC where there is one, clear of the
+   software ECC and bad block markers otherwise. Not ECC protected in
+   the software and no ECC modes. */
+extern uint16_t nand_tag_column(int n);
+
+/* Page 0 of the chip describes the boot image: the blocks holding it,
+   in order. The length is only known if the image was written by
+   nand_msc.c, otherwise it is -1 (erased). nand_msc.c writes a copy to
+   page 0 of block NAND_HDR_BACKUP before erasing block 0, and readers
+   fall back on it while page 0 names no first block, so a power loss
+   in between still boots. Images should stay out of that block. */
+#define NAND_IMAGE_BLOCKS 32
+#define NAND_HDR_BACKUP 1
+struct nand_image_hdr {
+	long blocks[NAND_IMAGE_BLOCKS];
+	long size;
+};
+/* The first len bytes of the header, from page 0 or the backup */
+extern int nand_image_hdr_read(void *buf, int len);
+
+/* Program FPGA from NAND data, returns when done */
 extern int program_fpga_from_nand(void);
+/* The same with the main loop kept going: after fpga_config_start,
+   fpga_config_run plays the image and calls background() every few
+   hundred bytes, stopping with an error once that returns nonzero.
+   While busy the NAND and JTAG lines are taken, so the FLASH and
+   Blaster interfaces must leave them alone. */
+enum { FPGA_CONFIG_IDLE, FPGA_CONFIG_BUSY, FPGA_CONFIG_DONE, FPGA_CONFIG_FAILED };
+extern struct fpga_config_status {
+	uint8_t state;		/* FPGA_CONFIG_* */
+	int8_t result;		/* From libxsvf_play once done */
+	uint32_t bytes;		/* XSVF bytes played */
+	uint32_t tcks;		/* TCK pulses given */
+} fpga_config;
+extern void fpga_config_start(void);
+/* Vendor IN request on the device returning struct fpga_config_status */
+#define FPGA_CONFIG_REQUEST 0x20
+extern int fpga_config_run(int (*background)(void));
 extern void nand_enable_write(void);
 extern void nand_disable_write(void);
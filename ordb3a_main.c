@@ -58,14 +58,25 @@
 
 #include "defs.h"
 #include "jtag.h"
-#include "safesleep.h"
+#include "xvc.h"
+#include "rbb.h"
+#include "sched.h"
+#include "i2cq.h"
 #include "nand_ordb3.h"
+#include "nand_msc.h"
+#include "nand_ftl.h"
 #include "uart.h"
+#include "usbtxq.h"
+#include "stats.h"
+#include "trace.h"
+#include "boottime.h"
 
 extern unsigned int boardInit(void);
 extern void fpga_powerdown(void);
 extern void fpga_powerup(void);
+extern enum fpga_power fpga_power_state(void);
 extern int check_pushbutton(void);
+extern void swi2cmst_setclock(unsigned long mclk);
 
 VOID Init_Ports (VOID);
 VOID Init_Clock (VOID);
@@ -75,10 +86,279 @@ static void inline Reset_TimerA1(void) {
 }
 BYTE retInString (char* string);
 
-volatile BYTE bHIDDataReceived_event = FALSE;   //Indicates data has been received without an open rcv operation
-volatile BYTE bTimerTripped_event = FALSE, bCommand = 0;
+volatile BYTE bCommand = 0;
 
 #define MAX_STR_LENGTH 64
+#define JTAG_SLICE 4	// Blaster packets per turn
+
+static char fpga_powered, configuring;
+static char reconfigure;	// FPGA lost power in suspend, play its image again
+static char mounted;		// FTL and mass storage are up
+static uint16_t again;	// Tasks that asked to run again, see sched.h
+
+/* The FTL may touch the NAND: it is powered and the XSVF player is done
+   with it. Otherwise FTL work waits for task_config to post it. */
+static int ftl_ok(void)
+{
+	return mounted && !configuring && fpga_powered &&
+		fpga_power_state()==FPGA_POWER_GOOD;
+}
+
+/*
+ * ======== Main loop tasks ========
+ * Each runs a bounded amount of work and returns nonzero if it has more.
+ */
+static int task_fpgacmd(void)
+{
+	// Check for commands from FPGA
+	uint8_t gotcommand = bCommand;
+	if (gotcommand & 0x80) {
+		bCommand = gotcommand & 0x7f;
+		// Handle command byte (7bit)
+		// Example thing to do: send I2C command to run power down sequence
+		// (Should reprogram power down sequence not to kill msp430 for wakeup)
+		uart_inject(bCommand);
+		if (ftl_ok()) {
+			ftl_log_byte(bCommand);
+			sched_post(TASK_FTL);
+		}
+	}
+	return 0;
+}
+
+static int task_jtag(void)
+{
+	int n, o, len;
+	unsigned char pieceOfString[MAX_STR_LENGTH];
+	unsigned char xvcReply[MAX_STR_LENGTH+XVC_SLACK];
+	unsigned char *reply;
+
+	if (configuring || USB_connectionState()!=ST_ENUM_ACTIVE)
+		return 0;  // JTAG is busy, or nobody to talk to; we get posted again
+	for (n=JTAG_SLICE; n--; ) {
+		xvc_update();  // Mode changes from XVC_REQUEST, between shifts
+		o=usbtxq_space(HID0_INTFNUM);
+		if (xvc_on) {
+			// XVC answers may be longer than the commands; what
+			// does not fit is held back (MAX_STR_LENGTH at most)
+			if (o>sizeof xvcReply)
+				o=sizeof xvcReply;
+			if (o<XVC_SLACK)
+				break;  // No room until the next send completes
+			len=xvc_held() ? 0 :
+				hidReceiveDataInBuffer(pieceOfString,
+						       MAX_STR_LENGTH,
+						       HID0_INTFNUM);
+			if (!len && !xvc_held())
+				break;
+			reply = xvcReply;
+			o = xvc_process_buffer(pieceOfString, len, reply, o);
+		} else {
+			// Blaster replies are never longer than the commands,
+			// so only take as many as we have room to answer
+			len=hidReceiveDataInBuffer(pieceOfString,
+						   o<MAX_STR_LENGTH ? o : MAX_STR_LENGTH,
+						   HID0_INTFNUM);
+			if (!len)
+				break;  // Empty, or no room until the next send completes
+			reply = pieceOfString;
+			o = usbblaster_process_buffer(pieceOfString, len);
+		}
+		if (o) {
+			// Replies wait for a full packet, or at most one latency period
+			if (!usbtxq_busy(HID0_INTFNUM))
+				Reset_TimerA1();
+			usbtxq_write(HID0_INTFNUM, reply, o);
+		}
+		// XVC hosts wait for each reply before the next command
+		if (xvc_on && xvc_idle())
+			usbtxq_flush(HID0_INTFNUM);
+	}
+	if (rbb_on)
+		rbb_service();  // CDC commands, see rbb.h
+	return n<0 && (USBHID_bytesInUSBBuffer(HID0_INTFNUM) ||
+		       (xvc_on && xvc_held()));
+}
+
+static int task_nand(void)
+{
+	int more;
+
+	/* Flash interface handling, once the FPGA has its image */
+	if (configuring || USB_connectionState()!=ST_ENUM_ACTIVE)
+		return 0;
+	more=nand_usb_service();
+#ifdef USE_MSC
+	more|=nand_msc_service();
+#endif
+	if (!more)
+		sched_post(TASK_FTL);  // Host may have left it work
+	return more;
+}
+
+static int task_timer(void)
+{
+	// Be sure to send status bytes now and then (16ms)
+	if (USB_connectionState()!=ST_ENUM_ACTIVE)
+		return 0;
+	usbtxq_flush(HID0_INTFNUM);  // Latency timer expired, send what we have
+	/* We don't care if this send fails, because that can only mean it wasn't needed
+	   (data already on its way, or USB disconnected) */
+	USBHID_sendData(0,0,HID0_INTFNUM);
+	nand_usb_tick();
+	USBHID_sendData(0,0,FLASH_INTFNUM);  // Only if the queue is idle
+	return 0;
+}
+
+static int task_usb(void)
+{
+	//Check the USB state and pick the sleep mode accordingly
+	switch (USB_connectionState())
+	{
+	case ST_USB_DISCONNECTED:
+		xvc_enable(0);  // Next host gets the Blaster
+		rbb_enable(0);  // and the UART
+		set_sleep_mode(LPM3_bits);
+		break;
+
+	case ST_ENUM_ACTIVE:
+		boottime_mark(BOOT_USB_ENUM);
+		if (!fpga_powered) {
+			fpga_powerup();
+			fpga_powered=1;
+			// Keep the Blaster and FLASH off the lines until the
+			// FPGA has its image back; TASK_CONFIG is posted
+			// again once the rails are up
+			reconfigure=1;
+			configuring=1;
+			sched_post(TASK_CONFIG);
+		}
+		set_sleep_mode(LPM0_bits);
+		// Anything that arrived while we were not looking
+		sched_post(TASK_JTAG);
+		sched_post(TASK_NAND);
+		break;
+
+	case ST_ENUM_SUSPENDED:
+		LED_OFF;                                                     //When suspended, turn off LED
+		if (fpga_powered) {
+			fpga_powerdown();
+			fpga_powered=0;
+		}
+		set_sleep_mode(LPM0_bits);
+		break;
+
+	case ST_USB_CONNECTED_NO_ENUM:
+	case ST_ENUM_IN_PROGRESS:
+		return 1;  // No event for the end of these, keep looking
+
+	case ST_NOENUM_SUSPENDED:
+		set_sleep_mode(LPM0_bits);
+		break;
+
+	case ST_ERROR:
+	default:;
+	}
+	return 0;
+}
+
+static int config_background(void);
+
+static int task_config(void)
+{
+	// Play the FPGA configuration; the other tasks run meanwhile
+	if (fpga_config.state==FPGA_CONFIG_BUSY &&
+	    fpga_power_state()==FPGA_POWER_GOOD)
+		fpga_config_run(config_background);
+	if (fpga_power_state()==FPGA_POWER_OFF) {
+		// Suspended before or while playing. NAND and JTAG stay
+		// off limits; task_usb has the image played on resume.
+		return 0;
+	}
+	if (reconfigure) {
+		// Resumed: once the rails are up, play the image again.
+		// NAND geometry and the image block list are kept from boot.
+		switch (fpga_power_state()) {
+		case FPGA_POWER_RAMP:
+			return 0;  // Posted again when PGOOD settles
+		case FPGA_POWER_GOOD:
+			reconfigure=0;
+			nand_resume();
+			fpga_config_start();
+			return 1;
+		default:
+			reconfigure=0;  // No power
+			break;
+		}
+	}
+	// NAND and JTAG are ours again
+	configuring=0;
+	if (!mounted) {
+		mounted=1;
+		boottime_mark(BOOT_FPGA);
+		boottime.xsvf_bytes=fpga_config.bytes;
+		boottime.xsvf_tcks=fpga_config.tcks;
+		boottime.xsvf_result=fpga_config.result;
+		ftl_mount();
+#ifdef USE_MSC
+		nand_msc_init();
+#endif
+	}
+	sched_post(TASK_JTAG);
+	sched_post(TASK_NAND);
+	if (ftl_ok())
+		sched_post(TASK_FTL);
+	return 0;
+}
+
+static int task_ftl(void)
+{
+	/* Log writes and garbage collection */
+	if (!ftl_ok())
+		return 0;  // Posted again from task_config
+	return ftl_idle();
+}
+
+static int (* const tasks[TASK_NUM])(void) = {
+	[TASK_FPGACMD] = task_fpgacmd,
+	[TASK_JTAG] = task_jtag,
+	[TASK_NAND] = task_nand,
+	[TASK_TIMER] = task_timer,
+	[TASK_USB] = task_usb,
+	[TASK_I2C] = i2cq_step,
+	[TASK_CONFIG] = task_config,
+	[TASK_FTL] = task_ftl,
+};
+
+static void run_task(uint8_t task)
+{
+	uint32_t t=stats_now();
+	uint16_t d;
+
+	TRACE(TRACE_TASK, task);
+	if (tasks[task]())
+		again |= 1<<task;
+	// Not task_config, whose time is mostly the other tasks
+	if ((d=stats_since(t))>stats.task_max && task!=TASK_CONFIG)
+		stats.task_max=d;
+}
+
+/* Called by the FPGA configuration player every few hundred bytes, on
+   top of its stack: one pass over everything else that was posted,
+   without sleeping. Nonzero stops the player, when the FPGA and NAND
+   are losing power. */
+static int config_background(void)
+{
+	uint8_t task;
+
+	while ((task=sched_take_from(~(1<<TASK_CONFIG)))<TASK_NUM)
+		run_task(task);
+	for (task=0; task<TASK_NUM; task++)
+		if (again & (1<<task))
+			sched_post(task);
+	again=0;
+	return fpga_power_state()!=FPGA_POWER_GOOD;
+}
 
 unsigned int SlowToggle_Period = 20000 - 1;
 unsigned int FastToggle_Period = 1000 - 1;
@@ -89,18 +369,26 @@ unsigned int FastToggle_Period = 1000 - 1;
 extern void Do_NAND_Probe(void);
 int main (VOID)
 {
-	char fpga_powered=0;
     WDTCTL = WDTPW + WDTHOLD;                                   //Stop watchdog timer
+    boottime_start();
 
     Init_Ports();                                               //Init ports (do first ports because clocks do change ports)
+    boottime_mark(BOOT_PMIC);
     fpga_powered=1;
     SetVCore(3);	// Do this before accessing NAND but after talking to PM chip on I²C
+    boottime_mark(BOOT_VCORE);
     Init_Clock();                                               //Init clocks
+    boottime_clock();
+    stats_init();
+    boottime_mark(BOOT_CLOCK);
+    swi2cmst_setclock(USB_MCLK_FREQ);	// PM chip I²C timing follows MCLK
 
     Do_NAND_Probe();	// Initializes NAND and enables ECC
+    boottime_mark(BOOT_NAND);
 
-    // Configure FPGA
-    program_fpga_from_nand();
+    // Configure FPGA in the background, so USB comes up right away
+    fpga_config_start();
+    configuring=1;
 
     USB_init();                                 //init USB
     Init_TimerA1();
@@ -118,175 +406,31 @@ int main (VOID)
         USB_handleVbusOnEvent();
     }
 
+    sched_post(TASK_USB);
+    sched_post(TASK_CONFIG);
     init_sleep(LPM0_bits);
+    boottime_mark(BOOT_INIT);
     __enable_interrupt();                           //Enable interrupts globally
     while (1)
     {
-        // Check for commands from FPGA
-        uint8_t gotcommand = bCommand;
-	if (gotcommand & 0x80) {
-		bCommand = gotcommand & 0x7f;
-		// Handle command byte (7bit)
-		// Example thing to do: send I2C command to run power down sequence
-		// (Should reprogram power down sequence not to kill msp430 for wakeup)
-		uart_inject(bCommand);
-	}
-        //Check the USB state and directly main loop accordingly
-        switch (USB_connectionState())
-        {
-            case ST_USB_DISCONNECTED:
-		    set_sleep_mode(LPM3_bits);
-		    enter_sleep();
-                break;
-
-            case ST_USB_CONNECTED_NO_ENUM:
-                break;
-
-            case ST_ENUM_ACTIVE:
-		    if (!fpga_powered) {
-			    fpga_powerup();
-			    fpga_powered=1;
-		    }
-		    set_sleep_mode(0);
-		    enter_sleep();
-
-                                                                                    //Exit LPM on USB receive and perform a receive
-                                                                                    //operation
-                if (bHIDDataReceived_event){                                        //Some data is in the buffer; begin receiving a
-                                                                                    //command
-		    int i, o, len;
-                    unsigned char pieceOfString[MAX_STR_LENGTH] = "";                        //Holds the new addition to the string
-                    bHIDDataReceived_event = FALSE;  // Must be before receive
-
-		    do {
-
-			    len=hidReceiveDataInBuffer(pieceOfString,
-						       MAX_STR_LENGTH,
-						       HID0_INTFNUM);               //Get the next piece of the string
-
-			    o = usbblaster_process_buffer(pieceOfString, len);
-
-			    if (o) {
-				    Reset_TimerA1();   // No need, the new version will only send if USB has buffer free
-				    // However, either of these will do partial sends happily so we're
-				    // not sending at optimal bitrate. 
-				    hidSendDataWaitTilDone(pieceOfString,o,HID0_INTFNUM,0);
-			    }
-		    } while (len);
-                }
-
-		/* Flash interface handling */
-		if (nand_ready()) {
-			int len;
-			char buf[MAX_STR_LENGTH];
-			if (expect_nandreq()) {
-				len=USBHID_bytesInUSBBuffer(FLASH_INTFNUM);
-				if (len>=sizeof(struct nandreq)) {
-					/* Unlock flash */
-					nand_enable_write();  // raise WPn
-					hidReceiveDataInBuffer((BYTE*)&nand_state, sizeof(struct nandreq),
-							       FLASH_INTFNUM);
-					// Simple validation for now
-					if (nand_state.addr_bytes<8 &&
-					    !(nand_state.writelen&&nand_state.readlen)) {
-						process_nandreq();
-					} else {
-						// Invalid command, flush the buffer
-						hidReceiveDataInBuffer((BYTE*)buf, len, FLASH_INTFNUM);
-						nand_state.addr_bytes=0;
-						nand_state.writelen=0;
-						nand_state.readlen=0;
-					}
-					stay_awake();  // So we may process further data
-				} else if (len) {
-					// Too small a packet, discard the data
-					hidReceiveDataInBuffer((BYTE*)buf, len, FLASH_INTFNUM);
-					stay_awake();
-				}
-			} else if ((len=expect_nanddata())) {  // Yes, this is an assignment
-				len=hidReceiveDataInBuffer((BYTE*)buf,
-							   sizeof(buf)<len?sizeof(buf):len,
-							   FLASH_INTFNUM);
-				if (len) {
-					int origwrlen=nand_state.writelen;
-					process_nanddata(buf, len);
-#if 0
-					if (origwrlen!=nand_state.writelen) {
-						if (nand_state.writelen)
-							USBHID_sendData((BYTE*)&nand_state.writelen,
-									2,FLASH_INTFNUM);
-						else {
-							BYTE sendstate;
-							do {
-								// Retry until the 0 word gets through
-								sendstate=hidSendDataWaitTilDone((BYTE*)&nand_state.writelen,
-												 2,FLASH_INTFNUM,0);
-							} while (sendstate==3);
-						}
-					}
-#endif
-					stay_awake();
-				}
-			} else if (nand_state.readlen) {
-				/* FIXME now that we have multiple interfaces, we must not 
-				   spin on one of them like this... */
-				len=produce_nanddata(buf, sizeof(buf)<62?sizeof(buf):62);
-				hidSendDataWaitTilDone((BYTE*)buf,len,FLASH_INTFNUM,0);
-				stay_awake();
-			}
-		}
-		if (nand_state.readlen || USBHID_bytesInUSBBuffer(FLASH_INTFNUM)) {
-			stay_awake();  /* Waiting for NAND, don't sleep */
-		}
-
-		handle_uart();
-
-		if (bTimerTripped_event) {  // Be sure to send status bytes now and then (16ms)
-#if 0
-			static unsigned char cdc_data_buf[4]="00\r\n";
-			unsigned char fill=USBCDC_bytesInUSBBuffer(CDC0_INTFNUM);
-			cdc_data_buf[1]=(fill&0x0f) + '0';
-			cdc_data_buf[0]=(fill>>4) + '0';
-			if (cdc_data_buf[1] > '9') cdc_data_buf[1] += 'a'-'0';
-			if (cdc_data_buf[0] > '9') cdc_data_buf[0] += 'a'-'0';
-			USBCDC_sendData(cdc_data_buf, sizeof cdc_data_buf, CDC0_INTFNUM); // Worked!
-#endif
-
-			bTimerTripped_event = FALSE;
-			/* We don't care if this send fails, because that can only mean it wasn't needed
-			   (data already on its way, or USB disconnected) */
-			USBHID_sendData(0,0,HID0_INTFNUM);
-			USBHID_sendData(0,0,FLASH_INTFNUM);
-		}
-
-                break;
-
-            case ST_ENUM_SUSPENDED:
-                LED_OFF;                                                     //When suspended, turn off LED
-		if (fpga_powered) {
-			fpga_powerdown();
-			fpga_powered=0;
-		}
-		set_sleep_mode(LPM0_bits);
+	uint8_t task=sched_take();
+	uint32_t t=stats_now();
+
+	if (task<TASK_NUM) {
+		run_task(task);
+	} else if (again) {
+		// Unfinished tasks go again once everything posted has run
+		for (task=0; task<TASK_NUM; task++)
+			if (again & (1<<task))
+				sched_post(task);
+		again=0;
+	} else {
+		uint8_t deep=SR_sleep_mode==LPM3_bits;
+		TRACE(TRACE_SLEEP, SR_sleep);
 		enter_sleep();
-                break;
-
-            case ST_ENUM_IN_PROGRESS:
-		    //fpga_powerup();
-		    //fpga_powered=1;
-                break;
-
-            case ST_NOENUM_SUSPENDED:
-		set_sleep_mode(LPM0_bits);
-		enter_sleep();
-                break;
-
-            case ST_ERROR:
-                _NOP();
-                break;
-
-            default:;
-        }
+		TRACE(TRACE_WAKE, 0);
+		stats.sleep[deep]+=stats_now()-t;
+	}
     }  //while(1)
     return 0;
 } //main()
@@ -324,6 +468,7 @@ VOID Init_Clock (VOID)
 	// Alternative to not require XT1: reconfigure clock sources to internal
 	UCSCTL4 = SELA__REFOCLK | SELS__REFOCLK | SELM__REFOCLK;  // very slow
 	XT2_Bypass();   // Enable XT2 oscillator bypass
+	boottime_clock();  // Before ACLK speeds up under it
 	// All clocks based on XT2
 	UCSCTL4 = SELA__XT2CLK | SELS__XT2CLK | SELM__XT2CLK;
 #else
@@ -465,9 +610,8 @@ VOID Init_TimerA1 (VOID)
 __interrupt void TIMER1_A0_ISR (void)
 {
 	//PJOUT ^= BIT3;                                          //Toggle LED P1.0
-	bTimerTripped_event = TRUE;
 	// Wake main thread up
-	WAKEUP_IRQ(LPM3_bits);
+	SCHED_POST_IRQ(TASK_TIMER);
     	 __no_operation();                       // Required for debugger
 }
 
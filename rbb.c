@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <msp430.h>
+
+#include "USB_API/USB_Common/types.h"
+#include "USB_API/USB_CDC_API/UsbCdc.h"
+#include <usbConstructs.h>
+#include <descriptors.h>
+
+#include "rbb.h"
+#include "jtag.h"
+#include "sched.h"
+#include "stats.h"
+
+#define RBB_IN	64	/* Taken from the host at a time */
+#define RBB_OUT	128	/* Each of two answer buffers */
+
+/* Blaster bit mode byte (jtag.c): nCS and nCE stay high, OE off */
+#define BLASTER_BITS	0x0c
+#define BLASTER_TCK	0x01
+#define BLASTER_TMS	0x02
+#define BLASTER_TDI	0x10
+#define BLASTER_READ	0x40
+
+enum rbb_state {
+	RBB_OP,		/* Next opcode */
+	RBB_COUNT,	/* Collecting the count */
+	RBB_DATA,	/* Vector bytes of RBB_SHIFT or RBB_TMS */
+};
+
+uint8_t rbb_on;
+
+static struct {
+	uint8_t state;
+	uint8_t op;
+	uint8_t got, need;	/* Count bytes */
+	uint8_t pins;		/* Last '0'..'7', as a Blaster byte */
+	uint8_t reset;		/* rbb_enable happened, start over */
+	uint16_t bits;		/* Left to shift */
+} rbb;
+
+static uint8_t out[2][RBB_OUT];
+static uint8_t cur;		/* out[cur] is being filled */
+static uint16_t fill;
+static volatile uint8_t sending;	/* out[cur^1] is on its way */
+
+void rbb_enable(uint8_t on) {
+	rbb_on = on;
+	rbb.reset = 1;
+	if (on)
+		sched_post(TASK_JTAG);
+}
+
+uint8_t rbb_sent(void) {
+	sending = 0;
+	sched_post(TASK_JTAG);
+	return TRUE;
+}
+
+static void rbb_send(void) {
+	unsigned short bGIE = __get_SR_register() & GIE;
+
+	__disable_interrupt();
+	if (fill && !sending) {
+		if (USBCDC_sendData(out[cur], fill, CDC0_INTFNUM) ==
+		    kUSBCDC_sendStarted) {
+			stats.tx[CDC0_INTFNUM]+=fill;
+			sending = 1;
+			cur ^= 1;
+			fill = 0;
+		} else
+			stats.busy[CDC0_INTFNUM]++;  // UART data still going, it calls rbb_sent
+	}
+	__bis_SR_register(bGIE);
+}
+
+static void rbb_clocks(uint16_t n) {
+	stats.jtag_gpio_bits+=n;
+	for (; n>8; n-=8)
+		jtag_shift_bits(0, 0, 8);
+	jtag_shift_bits(0, 0, n);
+}
+
+/* Answers are never longer than what asked for them */
+static int rbb_process(uint8_t *buf, int len, uint8_t *o) {
+	int i=0, n=0;
+
+	while (i<len) {
+		uint8_t b, k;
+
+		switch (rbb.state) {
+		case RBB_OP:
+			b = buf[i++];
+			if (b>='0' && b<='7') {
+				b -= '0';
+				rbb.pins = BLASTER_BITS |
+					(b&4 ? BLASTER_TCK : 0) |
+					(b&2 ? BLASTER_TMS : 0) |
+					(b&1 ? BLASTER_TDI : 0);
+				if (b&4)
+					stats.jtag_gpio_bits++;
+				usbblaster_byte(rbb.pins);
+			} else if (b=='R') {
+				o[n++] = usbblaster_byte(rbb.pins|BLASTER_READ)&1 ? '1' : '0';
+			} else if ((b&~(RBB_READ|RBB_EXIT))==RBB_SHIFT ||
+				   b==RBB_CLOCKS) {
+				rbb.op = b;
+				rbb.bits = rbb.got = 0;
+				rbb.need = 2;
+				rbb.state = RBB_COUNT;
+			} else if (b==RBB_TMS) {
+				rbb.op = b;
+				rbb.bits = rbb.got = 0;
+				rbb.need = 1;
+				rbb.state = RBB_COUNT;
+			}
+			// Anything else has no pins here to drive
+			break;
+
+		case RBB_COUNT:
+			rbb.bits |= (uint16_t)buf[i++] << (8*rbb.got);
+			if (++rbb.got < rbb.need)
+				break;
+			if (rbb.op==RBB_CLOCKS) {
+				if (rbb.bits)
+					rbb_clocks(rbb.bits);
+				rbb.state = RBB_OP;
+			} else
+				rbb.state = rbb.bits ? RBB_DATA : RBB_OP;
+			break;
+
+		case RBB_DATA:
+			if (rbb.op==RBB_TMS) {
+				k = rbb.bits<8 ? rbb.bits : 8;
+				jtag_shift_bits(0, buf[i++], k);
+				stats.jtag_gpio_bits+=k;
+				rbb.bits -= k;
+			} else {
+				uint16_t bytes = (rbb.bits+7)/8, bits;
+				if (bytes > len-i)
+					bytes = len-i;
+				bits = rbb.bits<bytes*8 ? rbb.bits : bytes*8;
+				jtag_shift_tdi(buf+i, bits,
+					       (rbb.op&RBB_EXIT) && bits==rbb.bits);
+				if (rbb.op&RBB_READ)
+					for (k=0; k<bytes; k++)
+						o[n++] = buf[i+k];
+				i += bytes;
+				rbb.bits -= bits;
+			}
+			if (!rbb.bits)
+				rbb.state = RBB_OP;
+			break;
+		}
+	}
+	return n;
+}
+
+void rbb_service(void) {
+	uint8_t in[RBB_IN];
+	int n, room;
+
+	if (rbb.reset) {
+		rbb.reset = 0;
+		rbb.state = RBB_OP;
+		rbb.pins = BLASTER_BITS;
+		fill = 0;
+		usb_jtag_state.bytes_to_shift = 0;  // Drop any Blaster byte shift
+	}
+	for (;;) {
+		room = RBB_OUT-fill;
+		if (room > RBB_IN)
+			room = RBB_IN;
+		n = room ? cdcReceiveDataInBuffer(in, room, CDC0_INTFNUM) : 0;
+		if (!n)
+			break;  // Empty, or full until rbb_sent
+		fill += rbb_process(in, n, out[cur]+fill);
+	}
+	rbb_send();
+}
@@ -0,0 +1,36 @@
+/* OpenOCD remote_bitbang on the CDC interface, plus batched opcodes for
+   scripted test benches. Setting the line coding to RBB_BAUD takes the
+   CDC interface from the FPGA UART; any other rate gives it back, as
+   does a disconnect. From Linux, for instance:
+     stty -F /dev/ttyACM0 raw 50
+     socat TCP-LISTEN:3335,reuseaddr FILE:/dev/ttyACM0,raw
+   and OpenOCD with "adapter driver remote_bitbang", port 3335.
+
+   remote_bitbang:
+     '0'..'7'  set TCK (4), TMS (2) and TDI (1)
+     'R'       read TDO, answered '0' or '1'
+     'r'..'u' (TRST, SRST), 'B' 'b' (LED), 'Q': no such pins, ignored
+   Batched; counts are little endian, vectors LSB first:
+     RBB_SHIFT|flags <bits:2> <TDI vector>
+               Shift with TMS low. RBB_READ answers the TDO vector,
+               RBB_EXIT raises TMS on the last bit.
+     RBB_TMS <bits:1> <TMS vector>	TMS path, TDI low
+     RBB_CLOCKS <n:2>			n TCK with TMS and TDI low
+   Answers to everything taken in at once go back in one transfer. */
+
+#define RBB_BAUD	50	/* B50, not a rate anyone runs a UART at */
+
+#define RBB_SHIFT	0x80
+#define RBB_READ	0x01
+#define RBB_EXIT	0x02
+#define RBB_TMS		0x90
+#define RBB_CLOCKS	0x91
+
+extern uint8_t rbb_on;
+
+/* From USBCDC_handleSetLineCoding and disconnects */
+void rbb_enable(uint8_t on);
+/* From the main loop (TASK_JTAG) */
+void rbb_service(void);
+/* From USBCDC_handleSendCompleted; TRUE to wake the main loop */
+uint8_t rbb_sent(void);
@@ -0,0 +1,65 @@
+/**
+  Main loop scheduler, on top of safesleep.h.
+
+  Interrupt handlers post tasks by setting their bit in sched_ready. The
+  main loop takes the most urgent posted task and runs one slice of it,
+  then looks again, so a burst of JTAG traffic is served before anything
+  else has its turn. Once nothing is posted it sleeps; a post from an
+  interrupt clears SR_sleep like WAKEUP_IRQ, so that cannot race.
+
+  A task that returns nonzero is not done (polling the NAND, waiting for
+  room on USB). It is posted again only after every other posted task
+  has run, so pollers cannot starve the rest.
+*/
+
+#include "safesleep.h"
+
+/* In priority order, most urgent first */
+enum sched_task {
+	TASK_FPGACMD,	/* PORT1: command byte from the FPGA */
+	TASK_JTAG,	/* Blaster OUT data or IN room */
+	TASK_NAND,	/* FLASH OUT data or IN room, mass storage */
+	TASK_TIMER,	/* Latency timer */
+	TASK_USB,	/* Connection state changed */
+	TASK_I2C,	/* PMIC requests queued, see i2cq.h */
+	TASK_CONFIG,	/* Background FPGA configuration */
+	TASK_FTL,	/* FTL log and garbage collection */
+	TASK_NUM
+};
+
+volatile uint16_t sched_ready;
+
+/* From the main loop, or from USB event handlers (which wake the main
+   loop by returning TRUE) */
+static inline void sched_post(uint8_t task) {
+	unsigned short bGIE = __get_SR_register() & GIE;
+	__disable_interrupt();
+	sched_ready |= 1<<task;
+	__bis_SR_register(bGIE);
+	stay_awake();
+}
+
+/* From our own interrupt handlers */
+#define SCHED_POST_IRQ(task) do {			\
+		sched_ready |= 1<<(task);		\
+		WAKEUP_IRQ(LPM3_bits);			\
+	} while (0)
+
+/* Take the most urgent posted task of those in mask, TASK_NUM if there
+   is none */
+static inline uint8_t sched_take_from(uint16_t mask) {
+	unsigned short bGIE = __get_SR_register() & GIE;
+	uint16_t bit=1;
+	uint8_t task;
+
+	__disable_interrupt();
+	for (task=0; task<TASK_NUM && !(sched_ready&mask&bit); task++)
+		bit<<=1;
+	sched_ready &= ~bit;
+	__bis_SR_register(bGIE);
+	return task;
+}
+
+static inline uint8_t sched_take(void) {
+	return sched_take_from(0xffff);
+}
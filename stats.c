@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include <msp430.h>
+
+#include "stats.h"
+
+struct stats stats;
+
+/* High half of the tick counter, TA0R is the low half */
+static volatile uint16_t ticks_hi;
+
+void stats_init(void) {
+	TA0CTL = TASSEL__ACLK | ID__8 | TACLR;
+	TA0EX0 = TAIDEX_7;	// ACLK/64 in all
+	TA0CTL |= MC__CONTINUOUS | TAIE;
+}
+
+uint32_t stats_now(void) {
+	unsigned short bGIE = __get_SR_register() & GIE;
+	uint16_t hi, lo;
+
+	__disable_interrupt();
+	lo = TA0R;
+	hi = ticks_hi;
+	if ((TA0CTL & TAIFG) && !(lo & 0x8000))
+		hi++;  // Wrapped, interrupt pending
+	__bis_SR_register(bGIE);
+	return ((uint32_t)hi << 16) | lo;
+}
+
+uint16_t stats_since(uint32_t then) {
+	uint32_t d = stats_now() - then;
+	return d > 0xffff ? 0xffff : d;
+}
+
+#pragma vector=TIMER0_A1_VECTOR
+__interrupt void TIMER0_A1_ISR (void)
+{
+	// Only TAIFG is enabled; reading TA0IV clears it
+	if (TA0IV == TA0IV_TA0IFG)
+		ticks_hi++;
+}
@@ -0,0 +1,41 @@
+/* Event and throughput counters, read by the host with the STATS_REQUEST
+   vendor request (IN returns struct stats, OUT clears it). Counters
+   wrap; the host is expected to take differences.
+
+   Times are in stats ticks: ACLK/64, free running in TA0. That is
+   375kHz on ORDB3A (ACLK from the 24MHz XT2) and 512Hz where ACLK is
+   the REFO. TA0 CCR0 is left for others (uart.c). */
+
+#if ORDB3A
+#define STATS_HZ	(24000000UL/64)
+#else
+#define STATS_HZ	(32768UL/64)
+#endif
+
+#define STATS_REQUEST	0x21
+
+/* Interfaces are counted by interface number */
+#define STATS_INTFS	3	/* HID0_INTFNUM, FLASH_INTFNUM, CDC0_INTFNUM */
+
+struct stats {
+	uint32_t rx[STATS_INTFS];	/* Bytes from the host */
+	uint32_t tx[STATS_INTFS];	/* Bytes to the host */
+	uint32_t jtag_spi_bits;		/* Blaster byte mode through the USCI */
+	uint32_t jtag_gpio_bits;	/* Bit mode, and byte mode without USCI */
+	uint32_t sleep[2];		/* Ticks asleep in LPM0 and LPM3 */
+	uint32_t nand_wait;		/* Ticks spent waiting for R/Bn */
+	uint16_t nand_waits;		/* R/Bn waits */
+	uint16_t nand_wait_max;		/* Longest R/Bn wait, ticks */
+	uint16_t task_max;		/* Longest main loop task slice, ticks */
+	uint16_t busy[STATS_INTFS];	/* Sends turned down, endpoint busy */
+	uint16_t txq_full;		/* Writes cut short by a full transmit queue */
+	uint16_t uart_rx_full;		/* UART receive buffer filled, UCRXIE off */
+};
+
+extern struct stats stats;
+
+/* Start the tick counter */
+extern void stats_init(void);
+extern uint32_t stats_now(void);
+/* Ticks since then, saturated to 16 bits */
+extern uint16_t stats_since(uint32_t then);
@@ -16,9 +16,15 @@
 ////    swi2cmst_clrbus(). Not guaranteed to work on all slaves.  ////
 ////    Slaves may be hung if the CPU/MCU was reset during an     ////
 ////    ongoing I2C transaction. There may also be other reasons. ////
-//// 3. Perform I2C accesses by calling one or more of            ////
+////    swi2cmst_start() does this by itself if it finds the bus  ////
+////    held low.                                                 ////
+//// 3. Call swi2cmst_setclock() whenever MCLK changes, so bit    ////
+////    times stay at the 400kHz Fast-mode minimums.              ////
+//// 4. Perform I2C accesses by calling one or more of            ////
 ////    swi2cmst_wr1(), swi2cmst_wr2(), swi2cmst_rd1(),           ////
 ////    swi2cmst_wr1rd1().                                        ////
+////    To chain several messages with repeated STARTs, use the   ////
+////    _rs variants and finish with swi2cmst_end().              ////
 ////                                                              ////
 //// References                                                   ////
 //// [1] UM10204 I2C-Bus Specification and User Manual            ////
@@ -64,16 +70,49 @@
 
 #include "swi2cmst.h"
 
+// Delay loop iterations per half bit; none needed out of reset, where a
+// port access already takes longer than tLOW.
+unsigned int swi2cmst_loops;
+
+// Set when a released SCL failed to go high; reported by the transfers
+static unsigned int busErr;
+
 void swi2cmst_init(void)
 {
 	SWI2CMST_INIT;
+	swi2cmst_setclock(SWI2CMST_MCLK_RESET);
+}
+
+void swi2cmst_setclock(unsigned long mclk)
+{
+	// About 4 cycles per loop, 1.3us: mclk/3077000 loops
+	swi2cmst_loops = mclk / 3000000;
+}
+
+static void swi2cmst_sclhi(void)
+{
+	unsigned int i = SWI2CMST_SCL_POLLS;
+
+	SWI2CMST_SCL_HI;
+	while (!SWI2CMST_SCL_GET) {
+		if (!--i) {
+			busErr = 1;
+			break;
+		}
+	}
 }
 
 void swi2cmst_start(void)
 {
+	unsigned int err = busErr;	// Keep one from before a repeated START
+
 	SWI2CMST_SDA_HI;
-	SWI2CMST_SCL_HI;
+	swi2cmst_sclhi();
 	SWI2CMST_DELAY;
+	// A slave left in the middle of a byte holds SDA low
+	if (!SWI2CMST_SDA_GET || busErr != err) {
+		busErr = err | (swi2cmst_clrbus() != SWI2CMST_OK);
+	}
 	SWI2CMST_SDA_LO;
 	SWI2CMST_DELAY;
 	SWI2CMST_SCL_LO;
@@ -83,7 +122,8 @@ void swi2cmst_start(void)
 void swi2cmst_stop(void)
 {
 	SWI2CMST_SDA_LO;
-	SWI2CMST_SCL_HI;
+	SWI2CMST_DELAY;
+	swi2cmst_sclhi();
 	SWI2CMST_DELAY;
 	SWI2CMST_SDA_HI;
 	SWI2CMST_DELAY;
@@ -93,7 +133,7 @@ void swi2cmst_wrbit(unsigned char b)
 {
 	SWI2CMST_SDA_SET(b);
 	SWI2CMST_DELAY;
-	SWI2CMST_SCL_HI;
+	swi2cmst_sclhi();
 	SWI2CMST_DELAY;
 	SWI2CMST_SCL_LO;
 	SWI2CMST_DELAY;
@@ -103,7 +143,7 @@ unsigned char swi2cmst_rdbit(void)
 {
 	unsigned char b;
 
-	SWI2CMST_SCL_HI;
+	swi2cmst_sclhi();
 	SWI2CMST_DELAY;
 	b = SWI2CMST_SDA_GET;
 	SWI2CMST_SCL_LO;
@@ -157,19 +197,36 @@ unsigned int swi2cmst_clrbus( void )
 {
 	int i;
 
-	// At least nine STOPs, to release potentially hung slaves
-	for(i = 10; i != 0; i--) {
-	   SWI2CMST_SCL_LO;
-       swi2cmst_stop();
+	// Up to nine clocks with SDA released, until the slave lets go of
+	// SDA; ref [1] section 3.1.16. Then a STOP to reset its state.
+	SWI2CMST_SDA_HI;
+	for(i = 9; i != 0 && !SWI2CMST_SDA_GET; i--) {
+		SWI2CMST_SCL_LO;
+		SWI2CMST_DELAY;
+		SWI2CMST_SCL_HI;
+		SWI2CMST_DELAY;
 	}
-	if (SWI2CMST_SDA_GET == 1 && SWI2CMST_SDA_GET == 1) {
+	SWI2CMST_SCL_LO;
+	SWI2CMST_DELAY;
+	swi2cmst_stop();
+	if (SWI2CMST_SDA_GET == 1 && SWI2CMST_SCL_GET == 1) {
 		return SWI2CMST_OK;
 	}
 	else {
-		return SWI2CMST_ERROR;
+		return SWI2CMST_BUSERR;
 	}
 }
 
+// Bus errors take precedence over a NAK
+static unsigned int swi2cmst_result(unsigned int result)
+{
+	if (busErr) {
+		busErr = 0;
+		return SWI2CMST_BUSERR;
+	}
+	return result;
+}
+
 unsigned int swi2cmst_wr1(unsigned int slaveAddr, unsigned int data)
 {
 	unsigned int result;
@@ -182,10 +239,15 @@ unsigned int swi2cmst_wr1(unsigned int slaveAddr, unsigned int data)
 		result = swi2cmst_rdack();
 	}
 	swi2cmst_stop();
-	return result;
+	return swi2cmst_result(result);
 }
 
 unsigned int swi2cmst_wr2(unsigned int slaveAddr, unsigned char data1, unsigned char data2)
+{
+	return swi2cmst_end(swi2cmst_wr2_rs(slaveAddr, data1, data2));
+}
+
+unsigned int swi2cmst_wr2_rs(unsigned int slaveAddr, unsigned char data1, unsigned char data2)
 {
 	unsigned int result;
 
@@ -200,7 +262,6 @@ unsigned int swi2cmst_wr2(unsigned int slaveAddr, unsigned char data1, unsigned
 		swi2cmst_wrbyte(data2);
 		result = swi2cmst_rdack();
 	}
-	swi2cmst_stop();
 	return result;
 }
 
@@ -216,10 +277,15 @@ unsigned int swi2cmst_rd1(unsigned int slaveAddr, unsigned char* pData)
 		swi2cmst_wrnack();
 	}
 	swi2cmst_stop();
-	return result;
+	return swi2cmst_result(result);
 }
 
 unsigned int swi2cmst_wr1rd1(unsigned int slaveAddr, unsigned char wrData, unsigned char* pRdData)
+{
+	return swi2cmst_end(swi2cmst_wr1rd1_rs(slaveAddr, wrData, pRdData));
+}
+
+unsigned int swi2cmst_wr1rd1_rs(unsigned int slaveAddr, unsigned char wrData, unsigned char* pRdData)
 {
 	unsigned int result;
 
@@ -239,8 +305,13 @@ unsigned int swi2cmst_wr1rd1(unsigned int slaveAddr, unsigned char wrData, unsig
 		*pRdData = swi2cmst_rdbyte();
 		swi2cmst_wrnack();
 	}
-	swi2cmst_stop();
 	return result;
 }
 
+unsigned int swi2cmst_end(unsigned int result)
+{
+	swi2cmst_stop();
+	return swi2cmst_result(result);
+}
+
 
@@ -135,7 +135,13 @@
 #define SWI2CMST_SDA_GET                                    \
 	                    (SWI2CMST_PINP & SWI2CMST_BSDA ? 1 : 0)
 //#define SWI2CMST_DELAY  _NOP()
-#define SWI2CMST_DELAY  __delay_cycles(50)
+// Half a bit time, sized by swi2cmst_setclock() for Fast-mode (400kHz):
+// tLOW >= 1.3us, tHIGH >= 0.6us, see ref [1] table 10.
+#define SWI2CMST_DELAY  swi2cmst_delay()
+// MCLK out of reset (DCOCLKDIV), until swi2cmst_setclock() says otherwise
+#define SWI2CMST_MCLK_RESET 1048576UL
+// Polls of a released SCL before we call it stuck (clock stretching)
+#define SWI2CMST_SCL_POLLS  1000
 
 
 #else
@@ -152,9 +158,21 @@
 #define SWI2CMST_MSB_MASK       0x80
 #define SWI2CMST_OK             0
 #define SWI2CMST_ERROR          1
+#define SWI2CMST_BUSERR         2 // SCL or SDA held low, see swi2cmst_clrbus()
 #define SWI2CMST_IGNORE_NAK     1 // 0 for normal operation, 1 for debugging without attached slave
 
+extern unsigned int swi2cmst_loops;
+
+static inline void swi2cmst_delay(void)
+{
+	unsigned int n = swi2cmst_loops;
+
+	while (n--)
+		__no_operation();
+}
+
 void swi2cmst_init(void);
+void swi2cmst_setclock(unsigned long mclk);
 void swi2cmst_start(void);
 void swi2cmst_stop(void);
 void swi2cmst_wrbit(unsigned char b);
@@ -169,5 +187,10 @@ unsigned int swi2cmst_wr1(unsigned int slaveAddr, unsigned int data);
 unsigned int swi2cmst_wr2(unsigned int slaveAddr, unsigned char data1, unsigned char data2);
 unsigned int swi2cmst_rd1(unsigned int slaveAddr, unsigned char* pData);
 unsigned int swi2cmst_wr1rd1(unsigned int slaveAddr, unsigned char wrData, unsigned char* pRdData);
+// Same without the STOP; the next message starts with a repeated START
+unsigned int swi2cmst_wr2_rs(unsigned int slaveAddr, unsigned char data1, unsigned char data2);
+unsigned int swi2cmst_wr1rd1_rs(unsigned int slaveAddr, unsigned char wrData, unsigned char* pRdData);
+// STOP after a chain of _rs messages, and the combined result
+unsigned int swi2cmst_end(unsigned int result);
 
 #endif /* SWI2CMST_H_ */
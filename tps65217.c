@@ -19,6 +19,8 @@
 ////    ongoing I2C transaction. There may also be other reasons. ////
 //// 3. Perform accesses to TPS65217 by calling one or more of    ////
 ////    tps65217_chipId(), tps65217_wrReg(), tps65217_rdReg().    ////
+//// 4. Apply tables of level 2 protected registers with          ////
+////    tps65217_setRegs().                                       ////
 ////                                                              ////
 //// References                                                   ////
 //// [1] TPS65217A, TPS65217B, TPS65217C                          ////
@@ -76,3 +78,53 @@ unsigned int tps65217_chipId(unsigned char* pChipId)
 {
 	return tps65217_rdReg(TPS65217_CHIPID, pChipId);
 }
+
+// Level 2 protected write: password, value, password, value (ref [1],
+// password protection). One burst, joined by repeated STARTs.
+unsigned int tps65217_wrRegPw2(unsigned char reg, unsigned char data)
+{
+	unsigned int result;
+
+	result  = swi2cmst_wr2_rs(TPS65217_SLAVEADDR, TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^reg);
+	result |= swi2cmst_wr2_rs(TPS65217_SLAVEADDR, reg, data);
+	result |= swi2cmst_wr2_rs(TPS65217_SLAVEADDR, TPS65217_PASSWORD, TPS65217_PASSWORD_VALUE^reg);
+	result |= swi2cmst_wr2_rs(TPS65217_SLAVEADDR, reg, data);
+	return swi2cmst_end(result);
+}
+
+// Read back the entries in mask (bit i for tab[i]) in one burst, and
+// return the mask of those that differ. All of them if the bus failed.
+unsigned int tps65217_verify(const struct tps65217_regval *tab, unsigned int n, unsigned int mask)
+{
+	unsigned int i, bit, result = TPS65217_OK, failed = 0;
+	unsigned char rv;
+
+	for (i = 0, bit = 1; i < n; i++, bit <<= 1) {
+		if (!(mask & bit))
+			continue;
+		rv = ~tab[i].val;
+		result |= swi2cmst_wr1rd1_rs(TPS65217_SLAVEADDR, tab[i].reg, &rv);
+		if (rv != tab[i].val)
+			failed |= bit;
+	}
+	if (swi2cmst_end(result) == SWI2CMST_BUSERR)
+		return mask;
+	return failed;
+}
+
+// Write a table of level 2 protected registers (at most 16 entries),
+// then verify, rewriting only the entries that did not stick.
+unsigned int tps65217_setRegs(const struct tps65217_regval *tab, unsigned int n)
+{
+	unsigned int i, bit, tries = TPS65217_TRIES;
+	unsigned int todo = n < 16 ? (1u << n) - 1 : 0xffff;
+
+	while (todo && tries--) {
+		for (i = 0, bit = 1; i < n; i++, bit <<= 1) {
+			if (todo & bit)
+				tps65217_wrRegPw2(tab[i].reg, tab[i].val);
+		}
+		todo = tps65217_verify(tab, n, todo);
+	}
+	return todo ? TPS65217_ERROR : TPS65217_OK;
+}
@@ -70,6 +70,15 @@
 #define TPS65217_PASSWORD		0x0b
 #define TPS65217_PASSWORD_VALUE	0x7d
 
+#define TPS65217_PGOOD		0x0c
+#define TPS65217_PGOOD_LDO2_PG	0x01
+#define TPS65217_PGOOD_LDO1_PG	0x02
+#define TPS65217_PGOOD_DC3_PG	0x04
+#define TPS65217_PGOOD_DC2_PG	0x08
+#define TPS65217_PGOOD_DC1_PG	0x10
+#define TPS65217_PGOOD_LS2_PG	0x20	// LS2 in LDO mode (LDO4)
+#define TPS65217_PGOOD_LS1_PG	0x40	// LS1 in LDO mode (LDO3)
+
 #define TPS65217_DEFDCDC1		0x0E
 #define TPS65217_DEFDCDC2		0x0F
 #define TPS65217_DEFDCDC3		0x10
@@ -110,6 +119,22 @@
 #define TPS65217_SEQ5	    0x1d
 #define TPS65217_SEQ6	    0x1e
 
+// Strobe of each rail in the sequence; 0 leaves it to ENABLE
+#define TPS65217_SEQ1_DC1(strobe)	((strobe)<<4)
+#define TPS65217_SEQ1_DC2(strobe)	(strobe)
+#define TPS65217_SEQ2_DC3(strobe)	((strobe)<<4)
+#define TPS65217_SEQ2_LDO1(strobe)	(strobe)
+#define TPS65217_SEQ3_LDO2(strobe)	((strobe)<<4)
+#define TPS65217_SEQ3_LS1(strobe)	(strobe)
+#define TPS65217_SEQ4_LS2(strobe)	((strobe)<<4)
+
+// Delay after strobe n: 1, 2, 5 or 10ms
+#define TPS65217_SEQ5_DLY1(ms)	(TPS65217_DLY(ms)<<6)
+#define TPS65217_SEQ5_DLY2(ms)	(TPS65217_DLY(ms)<<4)
+#define TPS65217_SEQ5_DLY3(ms)	(TPS65217_DLY(ms)<<2)
+#define TPS65217_SEQ5_DLY4(ms)	(TPS65217_DLY(ms))
+#define TPS65217_DLY(ms)	((ms) >= 10 ? 3 : (ms) >= 5 ? 2 : (ms) >= 2 ? 1 : 0)
+
 #define TPS65217_SEQ6_INSTDWN	0x01
 #define TPS65217_SEQ6_SEQDWN	0x02
 #define TPS65217_SEQ6_SEQUP	0x04
@@ -125,8 +150,20 @@
 #define TPS65217_OK             SWI2CMST_OK
 #define TPS65217_ERROR          SWI2CMST_ERROR
 
+// Write passes over a register table before giving up
+#define TPS65217_TRIES          5
+
+// One entry of a register table, see tps65217_setRegs()
+struct tps65217_regval {
+	unsigned char reg;
+	unsigned char val;
+};
+
 unsigned int tps65217_wrReg(unsigned char reg, unsigned char  data);
 unsigned int tps65217_rdReg(unsigned char reg, unsigned char* pData);
 unsigned int tps65217_chipId(unsigned char* pChipId);
+unsigned int tps65217_wrRegPw2(unsigned char reg, unsigned char data);
+unsigned int tps65217_verify(const struct tps65217_regval *tab, unsigned int n, unsigned int mask);
+unsigned int tps65217_setRegs(const struct tps65217_regval *tab, unsigned int n);
 
 #endif /* TPS65217_H_ */
@@ -0,0 +1,6 @@
+#include <stdint.h>
+#include <msp430.h>
+
+#include "trace.h"
+
+struct trace_buf trace;
@@ -0,0 +1,59 @@
+/* Timeline of hot path events, built with TRACE=1 (defines USE_TRACE).
+   Each TRACE() stores a 4 byte record, stamped with TA0R (the stats
+   tick, see stats.h), in a ring of TRACE_RECORDS.
+
+   The host reads the ring with TRACE_REQUEST IN, which also stops
+   recording so the dump holds still; TRACE_REQUEST OUT empties the ring
+   and starts again. Records run from trace.head-TRACE_RECORDS (or 0)
+   to trace.head-1, modulo TRACE_RECORDS. */
+
+#define TRACE_REQUEST	0x22
+
+enum trace_event {
+	TRACE_USB_RX=1,		/* arg: interface, data arrived */
+	TRACE_TASK,		/* arg: task from sched.h starts */
+	TRACE_BLASTER_START,	/* arg: bytes from host */
+	TRACE_BLASTER_END,	/* arg: bytes of reply */
+	TRACE_SPI_START,	/* arg: bytes to shift */
+	TRACE_SPI_END,
+	TRACE_NAND_BUSY,	/* R/Bn seen low */
+	TRACE_NAND_READY,
+	TRACE_SLEEP,		/* arg: SR bits */
+	TRACE_WAKE,
+};
+
+#ifdef USE_TRACE
+
+#define TRACE_RECORDS	128	/* Power of two */
+
+struct trace_rec {
+	uint8_t event, arg;
+	uint16_t time;
+};
+
+extern struct trace_buf {
+	uint16_t head;		/* Records ever written, wraps */
+	uint8_t stopped;
+	uint8_t reserved;
+	struct trace_rec rec[TRACE_RECORDS];
+} trace;
+
+static inline void TRACE(uint8_t event, uint8_t arg) {
+	unsigned short bGIE = __get_SR_register() & GIE;
+	struct trace_rec *r;
+
+	__disable_interrupt();
+	if (!trace.stopped) {
+		r = &trace.rec[trace.head++ & (TRACE_RECORDS-1)];
+		r->time = TA0R;
+		r->event = event;
+		r->arg = arg;
+	}
+	__bis_SR_register(bGIE);
+}
+
+#else
+
+#define TRACE(event, arg) do { } while (0)
+
+#endif
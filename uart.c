@@ -1,7 +1,9 @@
 #include <stdint.h>
+#include <string.h>
 
 #include "uart.h"
-#include "safesleep.h"
+#include "stats.h"
+#include "rbb.h"
 
 #include <F5xx_F6xx_Core_Lib/HAL_PMAP.h>
 
@@ -12,75 +14,230 @@
 
 #include <msp430.h>
 
+/* FPGA to host: UCA1 receive is moved by DMA0 into rxring, which it
+   treats as circular (repeated single transfers). The DMA interrupt
+   counts wraps, so DMA0SZ and rxwraps give the producer position.
+   Host to FPGA: txring, filled from CDC and drained by the TX
+   interrupt.
+
+   Everything runs in interrupt context (USB events, UART TX, DMA and
+   the receive timer), so interrupts are already off and nothing here
+   needs the main loop. */
+#define RXSIZE	512	/* Powers of two */
+#define TXSIZE	128
+#define INJSIZE	16
+
+/* Received data goes to the host once a packet has collected, or when
+   the line has been quiet for a timer period (TA0 CCR0 at stats ticks,
+   see stats.h) */
+#define RX_PACKET	64
+#define RX_TIMEOUT	(STATS_HZ/1000 ? STATS_HZ/1000 : 1)	/* 1ms */
+
+static uint8_t rxring[RXSIZE];
+static uint16_t rxwraps;
+static uint8_t txring[TXSIZE];
+static uint16_t txhead, txtail;
+
 static struct uart_state {
-	// Not quite ring buffers. ?xsiz indicate fill level of buffers,
-	// ?xo indicate consumed data level. 
-	// Probably should convert to ring buffer behaviour.
-	unsigned char rxbuf[64], txbuf[64];
-	unsigned char rxsiz, txsiz;
-	unsigned char rxo, txo;
-	volatile unsigned char sending;
+	uint16_t rxtail;	/* Sent to the host up to here */
+	uint16_t rxseen;	/* Head at the last timer tick */
+	uint16_t sending;	/* Bytes handed to USBCDC_sendData */
+	uint8_t injecting;	/* Those came from inj */
+	/* Diagnostic bytes, passed to the host ahead of UART data */
+	uint8_t inj[INJSIZE];
+	uint8_t injsiz;
 } state;
 
+/* Where DMA0 will store the next received byte, as a count of bytes */
+static uint16_t rx_head(void) {
+	uint16_t sz;
+	uint8_t wrapped;
+
+	do {
+		wrapped = DMA0CTL & DMAIFG;
+		sz = DMA0SZ;
+	} while (wrapped != (DMA0CTL & DMAIFG));
+	// A wrap with the interrupt still pending counts already
+	return (rxwraps + (wrapped ? 1 : 0))*RXSIZE + RXSIZE - sz;
+}
+
+/* Start a send to the host if there is enough, or any at all if force */
+static void rx_flush(uint8_t force) {
+	uint16_t n, off, head;
+	char result;
+
+	if (state.sending || rbb_on)
+		return;  // rbb.c has the interface while rbb_on
+	head = rx_head();
+	n = head - state.rxtail;
+	if (n > RXSIZE) {
+		// The host fell behind and DMA went round; drop the oldest half
+		state.rxtail = head - RXSIZE/2;
+		n = RXSIZE/2;
+		stats.uart_rx_full++;
+	}
+	state.injecting = state.injsiz != 0;
+	if (state.injecting) {
+		n = state.injsiz;
+		state.sending = n;
+		result = USBCDC_sendData(state.inj, n, CDC0_INTFNUM);
+	} else if (n >= RX_PACKET || (n && force)) {
+		off = state.rxtail & (RXSIZE-1);
+		if (n > RXSIZE - off)
+			n = RXSIZE - off;  // Rest after this one completes
+		state.sending = n;
+		result = USBCDC_sendData(rxring + off, n, CDC0_INTFNUM);
+	} else
+		return;
+	switch (result) {
+		// Possible results: generalError, busNotAvailable, intfBusyError, sendStarted
+	case kUSBCDC_sendStarted:
+		stats.tx[CDC0_INTFNUM]+=n;
+		break;
+	case kUSBCDC_intfBusyError:
+		stats.busy[CDC0_INTFNUM]++;
+		/* fall through */
+	default:
+		/* Data not submitted, the timer tries again */
+		state.sending = 0;
+	}
+}
+
+/* Host to FPGA: take what fits in txring, up to its wrap */
+static void tx_fill(void) {
+	uint16_t n = TXSIZE - (uint16_t)(txhead - txtail);
+	uint16_t off = txhead & (TXSIZE-1);
+
+	if (rbb_on)
+		return;  // CDC data is for rbb.c, read from the main loop
+	if (n > TXSIZE - off)
+		n = TXSIZE - off;
+	if (n) {
+		n = cdcReceiveDataInBuffer(txring + off, n, CDC0_INTFNUM);
+		if (n) {
+			txhead += n;
+			UCA1IE |= UCTXIE;
+		}
+	}
+}
+
 /*
  * This event indicates that a send operation on interface intfNum has just been completed.
  * returns TRUE to keep CPU awake
  */
 BYTE USBCDC_handleSendCompleted (BYTE intfNum)
 {
+	if (!state.sending)
+		return rbb_sent();
+	if (state.injecting) {
+		// Bytes injected meanwhile went in behind the ones sent
+		state.injsiz-=state.sending;
+		memmove(state.inj, state.inj+state.sending, state.injsiz);
+	} else
+		state.rxtail+=state.sending;
 	state.sending=0;
-	return (TRUE);   // Wake up
+	rx_flush(0);  // Keep going while full packets are waiting
+	return rbb_on ? rbb_sent() : FALSE;  // Its answers may be waiting
+}
+
+/* From USBCDC_handleDataReceived */
+void uart_cdc_received(void) {
+	tx_fill();
+}
+
+#pragma vector=DMA_VECTOR
+__interrupt void DMA_ISR (void)
+{
+	switch (__even_in_range(DMAIV, 16)) {
+	case DMAIV_DMA0IFG:	// rxring wrapped
+		rxwraps++;
+		rx_flush(0);
+		break;
+	}
+}
+
+#pragma vector=TIMER0_A0_VECTOR
+__interrupt void TIMER0_A0_ISR (void)
+{
+	uint16_t head = rx_head();
+
+	// Send what we have once nothing more came in for a period
+	TA0CCR0 += RX_TIMEOUT;
+	rx_flush(head == state.rxseen);
+	state.rxseen = head;
 }
 
 #pragma vector=USCI_A1_VECTOR
 __interrupt void USCI_A1_ISR (void)
 {
-	// Handle UART transfers
+	// Receive is done by DMA0, only transmit interrupts here
 	switch (UCA1IV) {
-	case 2: // Data received, store it in buffer
-		if (state.rxsiz < sizeof state.rxbuf)
-			state.rxbuf[state.rxsiz++] = UCA1RXBUF;
-		if (state.rxsiz==sizeof state.rxbuf) {
-			// Ran out of space, stop interrupt
-			UCA1IE &= ~UCRXIE;
-		}
-		// Wake up!
-		WAKEUP_IRQ(LPM3_bits);
-		break;
-	case 4: // Tx ready, send more from buffer
-		if (state.txo<state.txsiz) {
-			UCA1TXBUF = state.txbuf[state.txo++];
-		}
-		if (state.txo==state.txsiz) {
-			state.txo=0;
-			state.txsiz=0;
+	case 4: // Tx ready, send more from ring
+		if (txhead!=txtail) {
+			UCA1TXBUF = txring[txtail++ & (TXSIZE-1)];
+			if ((uint16_t)(txhead-txtail)==TXSIZE/2)
+				tx_fill();  // Room for more from USB
+		} else {
 			// Sent all available data, stop interrupt
 			UCA1IE &= ~UCTXIE;
-			// Wake up in case USB layer has more data
-			WAKEUP_IRQ(LPM3_bits);
+			tx_fill();
 		}
 		break;
 	}
 }
 
-void init_uart(void) {
-	// Set USCI_A1 to 115200 8N1
-	UCA1CTL1 |= UCSWRST;
-	UCA1CTL0 = UCMODE_0;  // 8N1 uart mode
-	UCA1CTL1 = BRCLK_SEL | UCSWRST;  // clock source per uart.h
+int uart_set_format(unsigned long baud, uint8_t stopbits, uint8_t parity,
+		    uint8_t databits) {
+	unsigned long n;	// BRCLK_FREQ/baud, in 1/16ths
+	uint16_t br;
+	uint8_t mctl, ctl0=UCMODE_0;
+
+	if (baud<BRCLK_FREQ/16/65535+1 || baud>BRCLK_FREQ/3)
+		return -1;
+	n=(BRCLK_FREQ*16UL+baud/2)/baud;
+	if (n>=16*16) {
+		// Oversampling, SLAU208 34.3.10.2: UCBRF is the fraction of N/16
+		br=n>>8;
+		mctl=((n&0xff)+8)>>4;
+		if (mctl==16) {
+			br++;
+			mctl=0;
+		}
+		mctl=(mctl<<4) | UCOS16;
+	} else {
+		// Low frequency mode: UCBRS is the fraction of N in eighths
+		br=n>>4;
+		mctl=((n&15)+1)>>1;
+		if (mctl==8) {
+			br++;
+			mctl=0;
+		}
+		mctl<<=1;
+	}
 
-	// for our case of 24MHz input, 115200 baud, we have an error of +0.16%(?)
-	// when not using any modulation. start with that for now. 
-	// Comparable baud rate setting from SLAU208:
-	// 12MHz 115200baud UCOS16=1 UCBR=6 UCBRS=0 UCBRF=8  (???)
-	// 12MHz 57600baud UCOS16=1 UCBR=13 UCBRS=0 UCBRF=0
-	// We may get best results using 57600 settings
-	UCA1BRW = ((BRCLK_FREQ+UART_BAUD*8)/UART_BAUD)/16;   // oversampling mode
-	UCA1MCTL= UCOS16;  // Turns out modulation won't help at this combination
+	if (parity==UART_PARITY_ODD)
+		ctl0|=UCPEN;
+	else if (parity==UART_PARITY_EVEN)
+		ctl0|=UCPEN|UCPAR;  // Mark and space parity are not supported, none
+	if (stopbits>1)
+		ctl0|=UCSPB;
+	if (databits==7)
+		ctl0|=UC7BIT;
+
+	UCA1CTL1 |= UCSWRST;  // Also clears UCA1IE
+	UCA1CTL0 = ctl0;
+	UCA1CTL1 = BRCLK_SEL | UCSWRST;  // clock source per uart.h
+	UCA1BRW = br;
+	UCA1MCTL = mctl;
 	//UCA1STAT= UCLISTEN;   // Loopback mode for initial testing
-	// ignore IR registers for now
-	UCA1IFG = /*UCTXIFG | UCRXIFG*/0; // TODO enable tx interrupt when data available
 	UCA1CTL1 &=~UCSWRST;
+	if (txhead!=txtail)
+		UCA1IE |= UCTXIE;
+	return 0;
+}
+
+void init_uart(void) {
+	uart_set_format(UART_BAUD, 1, UART_PARITY_NONE, 8);
 
 	// Enable USCI_A1 UART pin functions
 	// P4.4 = PM_UCA1TXD, P4.5 = PM_UCA1RXD
@@ -94,76 +251,35 @@ void init_uart(void) {
 	//configure_ports(&p4_6_map, &P4MAP6, 1, 1);
 	//P4SEL |= BIT6;
 
-	state.rxsiz=0;
-	state.txsiz=0;
-	state.txo=0;
-	state.rxo=0;
+	state.rxtail=0;
 	state.sending=0;
+	state.injsiz=0;
+	rxwraps=0;
+	txhead=txtail=0;
 
-	UCA1IE = UCRXIE;   // enable rx interrupt
-}
+	// DMA0 moves received bytes round rxring for good
+	DMA0CTL = 0;
+	DMACTL0 = (DMACTL0 & ~DMA0TSEL_31) | DMA0TSEL__USCIA1RX;
+	DMACTL4 |= DMARMWDIS;  // Not in the middle of read-modify-write (erratum DMA10)
+	DMA0SA = (uintptr_t)&UCA1RXBUF;
+	DMA0DA = (uintptr_t)rxring;
+	DMA0SZ = RXSIZE;
+	DMA0CTL = DMADT_4 | DMADSTINCR_3 | DMASBDB | DMAIE | DMAEN;
 
-void handle_uart(void) {
-	// Mark this whole function as a critical region; it interacts only with 
-	// uart and usb interrupts. 
-	// TODO: make this whole routine redundant by guaranteeing that the relevant
-	// interrupts are called. 
-	unsigned short bGIE  = (__get_SR_register() & GIE);
-	__disable_interrupt();
-
-	// receive tx chars from usb
-	if (state.txsiz<sizeof state.txbuf) {
-		// Main time waster
-		state.txsiz+=cdcReceiveDataInBuffer(state.txbuf+state.txsiz,
-						    sizeof state.txbuf-state.txsiz,
-						    CDC0_INTFNUM);
-		if (state.txsiz>state.txo)
-			UCA1IE |= UCTXIE;
-		else {
-			state.txsiz=0;
-			state.txo=0;
-		}
-		// Debug: USBCDC_sendData(state.txbuf, state.txsiz, CDC0_INTFNUM);
-	}
+	UCA1IE = 0;   // tx interrupt is enabled when there is data
 
-	// Pass rx chars to USB
-	if (state.rxsiz>state.rxo) {
-		char result, len=state.rxsiz-state.rxo;
-		state.sending=1;
-		result=USBCDC_sendData(state.rxbuf+state.rxo, len, CDC0_INTFNUM);
-		switch (result) {
-			// Possible results: generalError, busNotAvailable, intfBusyError, sendStarted
-		case kUSBCDC_sendComplete:   // can't happen
-			state.rxo+=len;
-			if (state.rxo==state.rxsiz) {
-				// last data transmitted, reset buffer
-				state.rxo=0;
-				state.rxsiz=0;
-			}
-			break;
-		case kUSBCDC_sendStarted:
-			state.rxo+=len;
-			break;
-		case kUSBCDC_intfBusyError:
-		default:
-			/* Data not submitted, no effect to care about */;
-		}
-	} else {
-		if (state.rxsiz==state.rxo && !state.sending) {
-			// last data transmitted, reset buffer
-			state.rxo=0;
-			state.rxsiz=0;
-		}
-		UCA1IE |= UCRXIE;
-	}
-	__bis_SR_register(bGIE);
+	// Receive timeout, on the free running TA0 (stats_init)
+	TA0CCR0 = TA0R + RX_TIMEOUT;
+	TA0CCTL0 = CCIE;
 }
 
 void uart_inject(unsigned char ch) {
 	// Used for diagnostic processing, sends things on USB.
 	unsigned short bGIE  = (__get_SR_register() & GIE);
 	__disable_interrupt();
-	if (state.rxsiz < sizeof state.rxbuf)
-		state.rxbuf[state.rxsiz++] = ch;
+	// While inj is being sent, append behind the bytes in flight
+	if (state.injsiz < sizeof state.inj)
+		state.inj[state.injsiz++] = ch;
+	rx_flush(1);
 	__bis_SR_register(bGIE);
 }
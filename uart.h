@@ -1,7 +1,16 @@
 #define BRCLK_FREQ 24000000
 #define BRCLK_SEL UCSSEL__SMCLK
-#define UART_BAUD 115200
+#define UART_BAUD 115200	/* Until the host sets the line coding */
 
+/* Parity as coded in CDC line coding */
+enum uart_parity { UART_PARITY_NONE, UART_PARITY_ODD, UART_PARITY_EVEN };
+
+/* Call after stats_init, the receive timeout runs on TA0 */
 void init_uart(void);
-void handle_uart(void);
+/* Reprogram UCA1; stopbits is 1 or 2, databits 7 or 8. Returns nonzero
+   if the rate is out of reach (BRCLK_FREQ/3 at most). */
+int uart_set_format(unsigned long baud, uint8_t stopbits, uint8_t parity,
+		    uint8_t databits);
+/* CDC data arrived, from USBCDC_handleDataReceived */
+void uart_cdc_received(void);
 void uart_inject(unsigned char ch);
@@ -49,7 +49,9 @@
 #endif
 
 #include <intrinsics.h>
+#include <stdint.h>
 #include "usbConstructs.h"
+#include "stats.h"
 
 
 /**************************************************************************************************
@@ -186,10 +188,11 @@ WORD hidReceiveDataInBuffer (BYTE* dataBuf, WORD size, BYTE intfNum)
             rxCount = size - (currentPos - dataBuf);
 			USBHID_receiveData(currentPos,rxCount,intfNum);
         	currentPos += rxCount;
-			return (currentPos - dataBuf);
+			break;
         }
     }
 	
+	stats.rx[intfNum] += currentPos - dataBuf;
 	return (currentPos - dataBuf);
 }
 
@@ -299,10 +302,11 @@ WORD cdcReceiveDataInBuffer (BYTE* dataBuf, WORD size, BYTE intfNum)
             rxCount = size - (currentPos - dataBuf);
 			USBCDC_receiveData(currentPos,rxCount,intfNum);
         	currentPos += rxCount;
-			return (currentPos - dataBuf);
+			break;
         }
     }
 	
+	stats.rx[intfNum] += currentPos - dataBuf;
 	return (currentPos - dataBuf);
 }
 
@@ -41,6 +41,11 @@
 #include "USB_config/descriptors.h"
 #include "USB_API/USB_Common/usb.h"
 #include "F5xx_F6xx_Core_Lib/HAL_UCS.h"
+#include <stdint.h>
+#include "sched.h"
+#include "uart.h"
+#include "rbb.h"
+#include "trace.h"
 
 #ifdef _CDC_
 #include "USB_API/USB_CDC_API/UsbCdc.h"
@@ -48,6 +53,7 @@
 
 #ifdef _HID_
 #include "USB_API/USB_HID_API/UsbHid.h"
+#include "usbtxq.h"
 #endif
 
 #ifdef _MSC_
@@ -58,9 +64,6 @@
 #include "USB_API/USB_PHDC_API/UsbPHDC.h"
 #endif
 
-//These variables are only example, they are not needed for stack
-extern volatile BYTE bHIDDataReceived_event;    //data received event
-
 /*
  * If this function gets executed, it's a sign that the output of the USB PLL has failed.
  * returns TRUE to keep CPU awake
@@ -85,6 +88,7 @@ BYTE USB_handleVbusOnEvent ()
         USB_reset();
         USB_connect();                          //generate rising edge on DP -> the host enumerates our device as full speed device
     }
+    sched_post(TASK_USB);
     return (TRUE);                              //return TRUE to wake the main loop (in the case the CPU slept before interrupt)
 }
 
@@ -97,6 +101,7 @@ BYTE USB_handleVbusOffEvent ()
     //TO DO: You can place your code here
 
     XT2_Stop();
+    sched_post(TASK_USB);
 
     return (TRUE);                              //return TRUE to wake the main loop (in the case the CPU slept before interrupt)
 }
@@ -107,7 +112,7 @@ BYTE USB_handleVbusOffEvent ()
  */
 BYTE USB_handleResetEvent ()
 {
-    //TO DO: You can place your code here
+    sched_post(TASK_USB);
 
     return (TRUE);                              //return TRUE to wake the main loop (in the case the CPU slept before interrupt)
 }
@@ -119,7 +124,7 @@ BYTE USB_handleResetEvent ()
  */
 BYTE USB_handleSuspendEvent ()
 {
-    //TO DO: You can place your code here
+    sched_post(TASK_USB);
 
     return (TRUE);                              //return TRUE to wake the main loop (in the case the CPU slept before interrupt)
 }
@@ -131,7 +136,7 @@ BYTE USB_handleSuspendEvent ()
  */
 BYTE USB_handleResumeEvent ()
 {
-    //TO DO: You can place your code here
+    sched_post(TASK_USB);
 
     return (TRUE);                              //return TRUE to wake the main loop (in the case the CPU slept before interrupt)
 }
@@ -143,7 +148,7 @@ BYTE USB_handleResumeEvent ()
  */
 BYTE USB_handleEnumCompleteEvent ()
 {
-    //TO DO: You can place your code here
+    sched_post(TASK_USB);
 
     return (TRUE);                              //return TRUE to wake the main loop (in the case the CPU slept before interrupt)
 }
@@ -156,9 +161,14 @@ BYTE USB_handleEnumCompleteEvent ()
  */
 BYTE USBCDC_handleDataReceived (BYTE intfNum)
 {
-    //TO DO: You can place your code here
+    TRACE(TRACE_USB_RX, intfNum);
+    if (rbb_on){
+        sched_post(TASK_JTAG);                  //JTAG commands, see rbb.h
+        return (TRUE);
+    }
+    uart_cdc_received();                        //Straight into the UART transmit ring
 
-    return (TRUE);                             //return FALSE to go asleep after interrupt (in the case the CPU slept before
+    return (FALSE);                             //return FALSE to go asleep after interrupt (in the case the CPU slept before
                                                 //interrupt)
 }
 
@@ -192,7 +202,17 @@ BYTE USBCDC_handleReceiveCompleted (BYTE intfNum)
  */
 BYTE USBCDC_handleSetLineCoding (BYTE intfNum, ULONG lBaudrate)
 {
-    //TO DO: You can place your code here
+    BYTE stopBits, parity, dataBits;
+
+    //RBB_BAUD hands the interface to the JTAG command set
+    rbb_enable(lBaudrate == RBB_BAUD);
+    if (rbb_on){
+        return (TRUE);
+    }
+
+    //Pass the host's settings on to the FPGA UART; 1.5 stop bits become 2
+    USBCDC_getLineFormat(intfNum, &stopBits, &parity, &dataBits);
+    uart_set_format(lBaudrate, stopBits ? 2 : 1, parity, dataBits);
 
     return (FALSE);                             //return FALSE to go asleep after interrupt (in the case the CPU slept before
                                                 //interrupt)
@@ -215,9 +235,8 @@ BYTE USBCDC_handleSetControlLineState (BYTE intfNum, BYTE lineState)
  */
 BYTE USBHID_handleDataReceived (BYTE intfNum)
 {
-    //TO DO: You can place your code here
-
-    bHIDDataReceived_event = TRUE;              //data received event
+    TRACE(TRACE_USB_RX, intfNum);
+    sched_post(intfNum==HID0_INTFNUM ? TASK_JTAG : TASK_NAND);
 
     return (TRUE);                              //return FALSE to go asleep after interrupt (in the case the CPU slept before
                                                 //interrupt)
@@ -229,9 +248,10 @@ BYTE USBHID_handleDataReceived (BYTE intfNum)
  */
 BYTE USBHID_handleSendCompleted (BYTE intfNum)
 {
-    //TO DO: You can place your code here
+    usbtxq_sent(intfNum);                       //Start the next queued send
+    sched_post(intfNum==HID0_INTFNUM ? TASK_JTAG : TASK_NAND);  //Room to reply
 
-    return (FALSE);                             //return FALSE to go asleep after interrupt (in the case the CPU slept before
+    return (TRUE);                             //return FALSE to go asleep after interrupt (in the case the CPU slept before
                                                 //interrupt)
 }
 
@@ -324,8 +344,8 @@ BYTE *USBHID_handleGetReport (BYTE reportType, BYTE reportId,
 #ifdef _MSC_
 BYTE USBMSC_handleBufferEvent (VOID)
 {
-    return (FALSE);                             //return FALSE to go asleep after interrupt (in the case the CPU slept before
-                                                //interrupt)
+    sched_post(TASK_NAND);
+    return (TRUE);                              //wake up, nand_msc_service() has a buffer to fill or drain
 }
 
 #endif //_MSC_
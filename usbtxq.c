@@ -0,0 +1,108 @@
+#include <stdint.h>
+#include <string.h>
+#include <msp430.h>
+
+#include "USB_API/USB_Common/types.h"
+#include "USB_API/USB_HID_API/UsbHid.h"
+#include <descriptors.h>
+
+#include "usbtxq.h"
+#include "stats.h"
+
+#define MASK		(USBTXQ_SIZE-1)
+#define PACKET		(MAX_PACKET_SIZE-2)	/* FTDI status bytes go first */
+
+/* The rings live in spare USB RAM, placed by the linker (see the
+   Makefile). Each is USBTXQ_SIZE bytes, followed by a mirror of its
+   first PACKET bytes so a full packet can always be sent in one piece
+   across the wrap. */
+extern uint8_t usbtxq_ram0[USBTXQ_SIZE+PACKET], usbtxq_ram1[USBTXQ_SIZE+PACKET];
+
+/* head is only moved by producers, tail only by the interrupt;
+   head-tail is the fill level. */
+static struct usbtxq {
+	uint8_t *buf;
+	volatile uint16_t head, tail;
+	volatile uint16_t sending;	/* Bytes handed to USBHID_sendData */
+	volatile uint16_t flush;	/* Bytes after tail that go even as a short packet */
+} q[USBTXQ_INTFS] = {
+	{ usbtxq_ram0 },
+	{ usbtxq_ram1 },
+};
+
+/* Interrupts must be off, or we must be in the USB interrupt */
+static void usbtxq_kick(uint8_t intf) {
+	struct usbtxq *t=&q[intf];
+	uint16_t n=t->head-t->tail, off=t->tail&MASK;
+
+	if (t->sending)
+		return;
+	if (n>USBTXQ_SIZE+PACKET-off)
+		n=USBTXQ_SIZE+PACKET-off;  // Past the mirror, the rest goes next time
+	if (n>=PACKET)
+		n-=n%PACKET;  // Whole packets only; a flushed tail goes after them
+	else if (n>t->flush)
+		n=t->flush;
+	if (!n)
+		return;
+	if (USBHID_sendData(t->buf+off, n, intf)==kUSBHID_sendStarted)
+		t->sending=n;
+	else
+		stats.busy[intf]++;
+	/* If busy (status packet), completion of that will kick us again */
+}
+
+int usbtxq_space(uint8_t intf) {
+	return USBTXQ_SIZE-(q[intf].head-q[intf].tail);
+}
+
+int usbtxq_busy(uint8_t intf) {
+	return q[intf].head!=q[intf].tail;
+}
+
+int usbtxq_write(uint8_t intf, const void *data, int len) {
+	struct usbtxq *t=&q[intf];
+	const uint8_t *p=data;
+	unsigned short bGIE;
+	int space=usbtxq_space(intf), n, done;
+
+	if (len>space) {
+		len=space;
+		stats.txq_full++;
+	}
+	stats.tx[intf]+=len;
+	for (done=0; done<len; done+=n) {
+		uint16_t off=t->head&MASK;
+		n=USBTXQ_SIZE-off;
+		if (n>len-done)
+			n=len-done;
+		memcpy(t->buf+off, p+done, n);
+		if (off<PACKET)
+			memcpy(t->buf+USBTXQ_SIZE+off, p+done,
+			       n<PACKET-off ? n : PACKET-off);
+		t->head+=n;
+	}
+	bGIE=__get_SR_register()&GIE;
+	__disable_interrupt();
+	usbtxq_kick(intf);
+	__bis_SR_register(bGIE);
+	return len;
+}
+
+void usbtxq_flush(uint8_t intf) {
+	unsigned short bGIE=__get_SR_register()&GIE;
+
+	__disable_interrupt();
+	q[intf].flush=q[intf].head-q[intf].tail;
+	usbtxq_kick(intf);
+	__bis_SR_register(bGIE);
+}
+
+void usbtxq_sent(uint8_t intf) {
+	if (intf>=USBTXQ_INTFS)
+		return;
+	q[intf].tail+=q[intf].sending;
+	q[intf].flush-=q[intf].flush<q[intf].sending ? q[intf].flush : q[intf].sending;
+	q[intf].sending=0;
+	usbtxq_kick(intf);
+}
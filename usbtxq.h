@@ -0,0 +1,20 @@
+/* Transmit queues for the FTDI-style bulk interfaces (Blaster and
+   FLASH). Producers copy data in and return at once; the USB interrupt
+   starts the next send when the previous one completes, so the IN
+   buffers stay busy without the main loop waiting on the host. */
+
+#define USBTXQ_SIZE	256	/* Power of two; the Makefile places the rings */
+#define USBTXQ_INTFS	2	/* HID0_INTFNUM and FLASH_INTFNUM */
+
+/* Free space in bytes */
+int usbtxq_space(uint8_t intf);
+/* Queue up to len bytes, returns how many fit. Only whole packets are
+   sent, so short replies pile up until a packet fills or a flush. */
+int usbtxq_write(uint8_t intf, const void *data, int len);
+/* Send what is queued now, even if it ends in a short packet. Later
+   writes wait for the next full packet or flush again. */
+void usbtxq_flush(uint8_t intf);
+/* Nonzero while data is queued or on its way */
+int usbtxq_busy(uint8_t intf);
+/* Call from USBHID_handleSendCompleted */
+void usbtxq_sent(uint8_t intf);
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <string.h>
+#include <msp430.h>
+
+#include "jtag.h"
+#include "xvc.h"
+#include "sched.h"
+
+#define XVC_INFO	"xvcServer_v1.0:256\n"	/* 2*XVC_VECTOR */
+
+enum xvc_state {
+	XVC_HEADER,	/* Collecting a command in hdr */
+	XVC_TMS,	/* Storing the TMS vector */
+	XVC_TDI,	/* Shifting as TDI arrives */
+};
+
+uint8_t xvc_on;
+static volatile uint8_t xvc_want;	/* Mode asked for by xvc_enable */
+static volatile uint8_t xvc_reset;	/* xvc_enable happened, start over */
+
+static struct {
+	uint8_t state;
+	uint8_t got;		/* Bytes in hdr */
+	char hdr[11];		/* Longest is settck: */
+	uint32_t bits;		/* Left to shift */
+	uint32_t bytes, pos;	/* Vector length, bytes of it received */
+	uint8_t tms[XVC_VECTOR];
+	uint8_t held;		/* Input left over in hold */
+	uint8_t hold[XVC_HOLD];
+} xvc;
+
+void xvc_enable(uint8_t on) {
+	xvc_want = on;
+	xvc_reset = 1;
+	sched_post(TASK_JTAG);
+}
+
+void xvc_update(void) {
+	if (!xvc_reset)
+		return;
+	xvc_reset = 0;
+	xvc_on = xvc_want;
+	xvc.state = XVC_HEADER;
+	xvc.got = 0;
+	xvc.held = 0;
+	usb_jtag_state.bytes_to_shift = 0;  // Drop any Blaster byte shift
+	jtag_set_period(0);
+}
+
+int xvc_held(void) {
+	return xvc.held;
+}
+
+int xvc_idle(void) {
+	return xvc.state==XVC_HEADER && !xvc.got;
+}
+
+static uint32_t get_le32(const char *p) {
+	return (uint8_t)p[0] | (uint16_t)(uint8_t)p[1]<<8 |
+		(uint32_t)(uint8_t)p[2]<<16 | (uint32_t)(uint8_t)p[3]<<24;
+}
+
+/* A command may be complete in hdr; returns the reply length */
+static int xvc_command(uint8_t *out) {
+	if (xvc.got==8 && !memcmp(xvc.hdr, "getinfo:", 8)) {
+		xvc.got = 0;
+		memcpy(out, XVC_INFO, sizeof XVC_INFO-1);
+		return sizeof XVC_INFO-1;
+	}
+	if (xvc.got==10 && !memcmp(xvc.hdr, "shift:", 6)) {
+		xvc.got = 0;
+		xvc.bits = get_le32(xvc.hdr+6);
+		xvc.bytes = xvc.bits/8 + (xvc.bits&7 ? 1 : 0);
+		xvc.pos = 0;
+		if (xvc.bytes)
+			xvc.state = XVC_TMS;
+		return 0;
+	}
+	if (xvc.got==11 && !memcmp(xvc.hdr, "settck:", 7)) {
+		uint32_t ns = jtag_set_period(get_le32(xvc.hdr+7));
+		xvc.got = 0;
+		out[0] = ns;
+		out[1] = ns>>8;
+		out[2] = ns>>16;
+		out[3] = ns>>24;
+		return 4;
+	}
+	if (xvc.got==sizeof xvc.hdr)
+		xvc.got = 0;  // Not ours; drop it and hope to find the next
+	return 0;
+}
+
+int xvc_process_buffer(const uint8_t *buf, int len, uint8_t *out, int room) {
+	int i=0, o=0;
+
+	if (!len) {
+		buf = xvc.hold;
+		len = xvc.held;
+	}
+	// Stop while any command could still answer in full
+	while (i<len && room-o>=XVC_SLACK) {
+		uint16_t n;
+
+		switch (xvc.state) {
+		case XVC_HEADER:
+			xvc.hdr[xvc.got++] = buf[i++];
+			o += xvc_command(out+o);
+			break;
+
+		case XVC_TMS:
+			// Longer vectors than we offered keep the stream in
+			// step, but only their TMS that fits is kept
+			n = xvc.bytes-xvc.pos < (uint32_t)(len-i) ?
+				xvc.bytes-xvc.pos : len-i;
+			if (xvc.pos < XVC_VECTOR)
+				memcpy(xvc.tms+xvc.pos, buf+i,
+				       xvc.pos+n > XVC_VECTOR ? XVC_VECTOR-xvc.pos : n);
+			i += n;
+			xvc.pos += n;
+			if (xvc.pos==xvc.bytes) {
+				xvc.pos = 0;
+				xvc.state = XVC_TDI;
+			}
+			break;
+
+		case XVC_TDI:
+			n = xvc.bytes-xvc.pos < (uint32_t)(len-i) ?
+				xvc.bytes-xvc.pos : len-i;
+			if (n > room-o)
+				n = room-o;
+			if (xvc.bytes > XVC_VECTOR) {
+				// Too long for us: answered with zeros, not shifted
+				memset(out+o, 0, n);
+			} else {
+				uint16_t bits = xvc.bits<n*8UL ? xvc.bits : n*8;
+				jtag_shift_vector(xvc.tms+xvc.pos, buf+i, out+o, bits);
+				xvc.bits -= bits;
+			}
+			i += n;
+			o += n;
+			xvc.pos += n;
+			if (xvc.pos==xvc.bytes)
+				xvc.state = XVC_HEADER;
+			break;
+		}
+	}
+	// The rest waits for room, ahead of anything new
+	memmove(xvc.hold, buf+i, len-i);
+	xvc.held = len-i;
+	return o;
+}
@@ -0,0 +1,35 @@
+/* Xilinx Virtual Cable on the Blaster interface (HID0). XVC_REQUEST OUT
+   with wValue 1 hands the interface to this command engine, wValue 0
+   gives it back to the Blaster; a disconnect does too. xvcbridge.py
+   passes the TCP stream from Vivado or OpenOCD through unchanged.
+
+   Commands, as in XVC 1.0:
+     getinfo:                          -> "xvcServer_v1.0:<bytes>\n"
+     settck:<period ns>                -> period set
+     shift:<bits><TMS vector><TDI vector> -> TDO vector
+   Numbers are 4 bytes little endian. Vectors are LSB first, (bits+7)/8
+   bytes each. TMS is held until TDI arrives, so <bytes>, both vectors
+   together, is 2*XVC_VECTOR. */
+
+#define XVC_REQUEST	0x24
+
+#define XVC_VECTOR	128	/* TMS bytes we can hold */
+/* Room for the longest answer to a single command */
+#define XVC_SLACK	24
+#define XVC_HOLD	64	/* Input held back, one packet */
+
+extern uint8_t xvc_on;
+
+/* From the XVC_REQUEST handler (USB interrupt) and disconnects. Only
+   records the mode; xvc_update applies it from task_jtag, between
+   shifts, and drops whatever either side was in the middle of. */
+void xvc_enable(uint8_t on);
+void xvc_update(void);
+/* Take len bytes of commands and answer them into out, at most room
+   bytes. Input whose answers do not fit is held back; call again with
+   len 0 while xvc_held() to go on with it before taking more. Returns
+   the length of the answer. */
+int xvc_process_buffer(const uint8_t *buf, int len, uint8_t *out, int room);
+int xvc_held(void);
+/* Nonzero between commands, when the reply is complete */
+int xvc_idle(void);
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Xilinx Virtual Cable server for the ORDB3A, over USB.
+
+Listens for XVC clients (Vivado hw_server, OpenOCD's xvc adapter) and
+passes their stream through to the firmware's XVC engine on interface A,
+the Blaster interface, which XVC_REQUEST switches over (see xvc.h).
+Replies come back in FTDI style packets; their two status bytes are
+dropped. Needs pyusb.
+
+    ./xvcbridge.py [--port 2542]
+"""
+
+import argparse
+import socket
+import threading
+
+import usb.core
+import usb.util
+
+VID, PID = 0x09fb, 0x6001
+INTF, EP_OUT, EP_IN = 0, 0x02, 0x81
+XVC_REQUEST = 0x24
+PACKET = 64
+
+
+def usb_to_tcp(dev, conn, stop):
+    while not stop.is_set():
+        try:
+            data = dev.read(EP_IN, PACKET, timeout=100)
+        except usb.core.USBTimeoutError:
+            continue
+        if len(data) > 2:
+            conn.sendall(bytes(data[2:]))
+
+
+def serve(dev, conn):
+    stop = threading.Event()
+    reader = threading.Thread(target=usb_to_tcp, args=(dev, conn, stop))
+    dev.ctrl_transfer(0x40, XVC_REQUEST, 1, 0)
+    reader.start()
+    try:
+        while True:
+            data = conn.recv(4096)
+            if not data:
+                break
+            dev.write(EP_OUT, data)
+    finally:
+        stop.set()
+        reader.join()
+        dev.ctrl_transfer(0x40, XVC_REQUEST, 0, 0)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--port", type=int, default=2542)
+    ap.add_argument("--bind", default="127.0.0.1")
+    args = ap.parse_args()
+
+    dev = usb.core.find(idVendor=VID, idProduct=PID)
+    if dev is None:
+        raise SystemExit("No ORDB3A found")
+    if dev.is_kernel_driver_active(INTF):
+        dev.detach_kernel_driver(INTF)
+    usb.util.claim_interface(dev, INTF)
+
+    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    srv.bind((args.bind, args.port))
+    srv.listen(1)
+    while True:
+        conn, peer = srv.accept()
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        print("XVC client", peer)
+        try:
+            serve(dev, conn)
+        except (OSError, usb.core.USBError) as e:
+            print(e)
+        conn.close()
+
+
+if __name__ == "__main__":
+    main()